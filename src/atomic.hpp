@@ -10,85 +10,98 @@
 #ifndef ATOMIC_HPP
 #define ATOMIC_HPP
 
-#include <TargetConditionals.h>
 #include <cassert>
+#include <cstddef>
 #include <stdint.h>
 
-void active_pause() {
-    asm volatile ("pause");
+// Everything here is a thin layer over the GCC/Clang __atomic builtins, so
+// each memory_order compiles to the cheapest sequence the target has: on
+// x86 relaxed, acquire and release loads and stores are plain moves, only
+// seq_cst stores need an xchg, and read-modify-writes are one locked
+// instruction whatever the order.
+
+enum memory_order
+{
+	memory_order_relaxed = __ATOMIC_RELAXED,
+    memory_order_consume = __ATOMIC_CONSUME,
+    memory_order_acquire = __ATOMIC_ACQUIRE,
+    memory_order_release = __ATOMIC_RELEASE,
+    memory_order_acq_rel = __ATOMIC_ACQ_REL,
+    memory_order_seq_cst = __ATOMIC_SEQ_CST
+};
+
+// Spin loop hint
+inline void active_pause() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile ("yield" ::: "memory");
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+inline void compiler_barrier() {
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
-void compiler_barrier() {
-	asm volatile ("" ::: "memory");
+// Full fence, orders earlier stores before later loads (StoreLoad)
+inline void memory_barrier() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 // Returns new value
 template< typename T >
 inline T atomic_increment(T& value) {
-	return __sync_add_and_fetch(&value, 1);
+	return __atomic_add_fetch(&value, 1, __ATOMIC_SEQ_CST);
 }
 
 template< typename T >
 inline T atomic_decrement(T& value) {
-	return __sync_sub_and_fetch(&value, 1);
+	return __atomic_sub_fetch(&value, 1, __ATOMIC_SEQ_CST);
+}
+
+// On failure expected is updated to the value seen
+template< typename T >
+inline bool atomic_compare_exchange(T& value, T& expected, T desired) {
+	return __atomic_compare_exchange_n(&value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
 template< typename T >
 inline T load_acquire(T const& x) {
-	T result = x;
-	compiler_barrier();
-	return result;
+	return __atomic_load_n(&x, __ATOMIC_ACQUIRE);
 }
 
 template< typename T >
 inline void store_release(T& out, T x) {
-	compiler_barrier();
-	out = x;
+	__atomic_store_n(&out, x, __ATOMIC_RELEASE);
 }
 
 template< typename T >
 inline T exchange_pointer(T volatile* address, T value) {
-	T compare, result = value;
-	do {
-		compare = result;
-		result = __sync_val_compare_and_swap(address, compare, value);
-	}
-	while(result != compare);
-	
-	return result;
+	return __atomic_exchange_n(address, value, __ATOMIC_SEQ_CST);
 }
 
-static inline uint64_t exchange64(void *ptr, uint64_t x)
-{
-	__asm__ __volatile__("xchgq %0,%1"
-                         :"=r" ((uint64_t) x)
-                         :"m" (*(volatile uint64_t *)ptr), "0" (x)
-                         :"memory");
-    
-	return x;
+inline uint64_t exchange64(void* ptr, uint64_t x) {
+	return __atomic_exchange_n(static_cast< uint64_t* >(ptr), x, __ATOMIC_SEQ_CST);
 }
 
 inline uint32_t exchange32(void* ptr, uint32_t x) {
-	__asm__ __volatile__("xchgl %0,%1"
-                         :"=r" ((uint32_t) x)
-                         :"m" (*(volatile uint32_t *)ptr), "0" (x)
-                         :"memory");
-    
-	return x;
+	return __atomic_exchange_n(static_cast< uint32_t* >(ptr), x, __ATOMIC_SEQ_CST);
 }
 
-
-enum memory_order
+namespace internal
 {
-	memory_order_relaxed,
-    memory_order_consume,
-    memory_order_acquire,
-    memory_order_release,
-    memory_order_acq_rel,
-    memory_order_seq_cst
-};
+	// A failed compare exchange is only a load, so it can't be a release
+	inline int failure_order(memory_order order) {
+		return order == memory_order_acq_rel ? __ATOMIC_ACQUIRE :
+			   order == memory_order_release ? __ATOMIC_RELAXED : order;
+	}
+}
 
-// sizeof(T) must be <= 8
+// sizeof(T) must be <= 8. The orders are passed straight to the builtins,
+// which need them to be constants once inlined; with optimisation off GCC
+// treats any order as seq_cst, which is slower but still correct.
 template< typename T >
 class atomic
 {
@@ -100,9 +113,7 @@ public:
 	
 	value_type load(memory_order order) const volatile {
 		assert(order != memory_order_release && order != memory_order_acq_rel);
-		value_type v = value_;
-		compiler_barrier();
-		return v;
+		return __atomic_load_n(&value_, order);
 	}
 	
 	void store(T value, memory_order order) volatile {
@@ -112,28 +123,28 @@ public:
 			order != memory_order_acq_rel
 		);
 		
-		if (order == memory_order_seq_cst) {
-			exchange_pointer(&value_, value);
-		}
-		else {
-			compiler_barrier();
-			value_ = value;
-		}
+		__atomic_store_n(&value_, value, order);
 	}
 	
 	bool compare_exchange_weak(T& compare, T exchange, memory_order order) volatile {
-		T previous = __sync_val_compare_and_swap(&value_, compare, exchange);
-		if (previous == compare) {
-			return true;
-		}
-		
-		compare = previous;
-		return false;
+		return __atomic_compare_exchange_n(&value_, &compare, exchange, true, order, internal::failure_order(order));
+	}
+	
+	bool compare_exchange_strong(T& compare, T exchange, memory_order order) volatile {
+		return __atomic_compare_exchange_n(&value_, &compare, exchange, false, order, internal::failure_order(order));
 	}
 	
 	value_type exchange(T v, memory_order order) volatile {
-        T previous = exchange_pointer(&value_, v);
-        return previous;
+		return __atomic_exchange_n(&value_, v, order);
+	}
+	
+	// Returns the previous value
+	value_type fetch_add(T v, memory_order order) volatile {
+		return __atomic_fetch_add(&value_, v, order);
+	}
+	
+	value_type fetch_sub(T v, memory_order order) volatile {
+		return __atomic_fetch_sub(&value_, v, order);
 	}
 	
 	value_type operator++() {
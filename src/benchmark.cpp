@@ -0,0 +1,979 @@
+/*
+ *  benchmark.cpp
+ *  Task Scheduler
+ *
+ */
+
+// Runs the same set of workloads against every scheduler over a sweep of
+// thread counts and writes the results as JSON, so builds can be compared.
+//
+//   c++ -O2 benchmark.cpp -o benchmark -lpthread
+//   ./benchmark [--threads 1,2,4] [--reps 3] [--quick] [--queues] [--latency] [--out results.json]
+//
+// Every task goes through bench_trampoline, which records the time from
+// submission to the task starting and keeps the count of outstanding tasks,
+// so completion is tracked the same way for every scheduler. Each
+// (scheduler, threads, workload) combination runs --reps times and the rep
+// with the median wall time is reported. All workloads are deterministic.
+//
+// The critical_path rows measure task_manager priorities: a trickle of
+// short critical tasks is submitted while the workers are saturated by a
+// backlog of background tasks, once with everything at normal priority and
+// once with the critical tasks high and the backlog at background priority.
+// Their latency columns are the critical tasks' submit-to-start times.
+//
+// The mpmc_bounded_queue rows time the queue on its own, to measure the
+// cost of the atomics on its hot path: enqueue/dequeue pairs and bulk
+// pairs on one thread, and one producer thread feeding one consumer.
+// Their latency columns are nanoseconds per element, measured over batches
+// of kQueueBatch elements. --queues runs only these.
+//
+// The frame rows submit the same parent with kFrameNodes empty children
+// every frame, once rebuilt with begin_add/add_child/end_add and once as a
+// prebuilt task_graph relaunched each frame. Their latency columns are the
+// per-frame wall times.
+//
+// The ping_pong and short_chain rows measure wake up latency: after an idle
+// gap long enough for the workers to park, the main thread submits one task,
+// or a chain of kShortChainLength tasks each submitting the next, and polls
+// until the last one has run. Each scheduler runs them with the default
+// settings and, as <scheduler>_spinning, with every worker spinning (see
+// scheduler_settings). Their latency columns are the submit to finish
+// times. --latency runs only these.
+
+#include "task_distributing_scheduler.hpp"
+#include "work_stealing_lock_scheduler.hpp"
+#include "task_manager.hpp"
+#include "task_graph.hpp"
+#include "mpmc_bounded_queue.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using internal::now_ns;
+
+void spin_for_ns(uint64_t duration) {
+    uint64_t end = now_ns() + duration;
+    while (now_ns() < end) {
+        active_pause();
+    }
+}
+
+//============================================================================
+// Harness
+//============================================================================
+struct bench_run;
+
+typedef void (*bench_func) (bench_run* run, intptr_t arg);
+
+struct bench_record
+{
+    bench_func func;
+    intptr_t arg;
+    bench_run* run;
+    uint64_t submitted;
+    uint64_t latency;
+};
+
+struct bench_run
+{
+    std::vector< bench_record > records;
+    atomic< size_t > next_record;
+    atomic< size_t > outstanding;
+    void (*submit)(void* scheduler, task_function func, void* context);
+    void* scheduler;
+    void* state;
+};
+
+void bench_trampoline(void* data) {
+    bench_record* record = static_cast< bench_record* >(data);
+    record->latency = now_ns() - record->submitted;
+    record->func(record->run, record->arg);
+    --(record->run->outstanding);
+}
+
+void spawn(bench_run* run, bench_func func, intptr_t arg) {
+    size_t index = run->next_record++;
+    assert(index < run->records.size());
+    bench_record* record = &run->records[index];
+    record->func = func;
+    record->arg = arg;
+    record->run = run;
+    ++(run->outstanding);
+    record->submitted = now_ns();
+    run->submit(run->scheduler, bench_trampoline, record);
+}
+
+void wait_for_run(bench_run* run) {
+    while (run->outstanding.load(memory_order_acquire) != 0) {
+        thread::yield();
+    }
+}
+
+//============================================================================
+// Workloads
+//============================================================================
+struct workload
+{
+    char const* name;
+    // Upper bound on the number of tasks one run spawns
+    size_t (*max_tasks)(size_t scale);
+    void (*start)(bench_run* run, size_t scale);
+};
+
+// Empty tasks: pure scheduling overhead
+void empty_task(bench_run*, intptr_t) {
+}
+
+size_t empty_max_tasks(size_t scale) {
+    return 100000 * scale;
+}
+
+void empty_start(bench_run* run, size_t scale) {
+    for (size_t i = 0; i < 100000 * scale; ++i) {
+        spawn(run, empty_task, 0);
+    }
+}
+
+// Recursive fib: every call above the cutoff spawns two more tasks
+enum { kFibN = 22 };
+
+void fib_task(bench_run* run, intptr_t n) {
+    if (n >= 2) {
+        spawn(run, fib_task, n - 1);
+        spawn(run, fib_task, n - 2);
+    }
+}
+
+size_t fib_max_tasks(size_t scale) {
+    // fib(n) makes 2 * F(n + 1) - 1 calls
+    size_t a = 0, b = 1;
+    for (int i = 0; i < kFibN + 1; ++i) {
+        size_t next = a + b;
+        a = b;
+        b = next;
+    }
+
+    return (2 * a - 1) * scale;
+}
+
+void fib_start(bench_run* run, size_t scale) {
+    for (size_t i = 0; i < scale; ++i) {
+        spawn(run, fib_task, kFibN);
+    }
+}
+
+// Mandelbrot: 16x16 blocks of a 1024x1024 image, one task per block
+enum { kMandelbrotSize = 1024, kMandelbrotBlock = 16 };
+enum { kMandelbrotBlocksPerRow = kMandelbrotSize / kMandelbrotBlock };
+
+void mandelbrot_task(bench_run* run, intptr_t block) {
+    uint8_t* image = static_cast< uint8_t* >(run->state);
+    size_t bx = (block % kMandelbrotBlocksPerRow) * kMandelbrotBlock;
+    size_t by = ((block / kMandelbrotBlocksPerRow) % kMandelbrotBlocksPerRow) * kMandelbrotBlock;
+    double delta = 3.0 / kMandelbrotSize;
+    for (size_t y = by; y < by + kMandelbrotBlock; ++y) {
+        for (size_t x = bx; x < bx + kMandelbrotBlock; ++x) {
+            double cr = -2.0 + x * delta, ci = -1.5 + y * delta;
+            double zr = cr, zi = ci, zr2 = 0.0, zi2 = 0.0;
+            unsigned i = 0;
+            do {
+                zr2 = zr * zr;
+                zi2 = zi * zi;
+                zi = 2.0 * zr * zi + ci;
+                zr = zr2 - zi2 + cr;
+            } while (zr2 + zi2 < 4.0 && ++i < 256);
+            image[y * kMandelbrotSize + x] = uint8_t(i);
+        }
+    }
+}
+
+size_t mandelbrot_max_tasks(size_t scale) {
+    return kMandelbrotBlocksPerRow * kMandelbrotBlocksPerRow * scale;
+}
+
+void mandelbrot_start(bench_run* run, size_t scale) {
+    for (size_t i = 0; i < mandelbrot_max_tasks(scale); ++i) {
+        spawn(run, mandelbrot_task, i);
+    }
+}
+
+// Wide fan-out / fan-in: a root spawns kFanWidth leaves, the last leaf to
+// finish spawns the join task, which starts the next round.
+enum { kFanWidth = 1024, kFanRounds = 32 };
+
+struct fan_state
+{
+    atomic< size_t > remaining;
+    intptr_t rounds;
+};
+
+void fan_root_task(bench_run* run, intptr_t round);
+
+void fan_join_task(bench_run* run, intptr_t round) {
+    fan_state* state = static_cast< fan_state* >(run->state);
+    if (round + 1 < state->rounds) {
+        spawn(run, fan_root_task, round + 1);
+    }
+}
+
+void fan_leaf_task(bench_run* run, intptr_t round) {
+    fan_state* state = static_cast< fan_state* >(run->state);
+    if (--(state->remaining) == 0) {
+        spawn(run, fan_join_task, round);
+    }
+}
+
+void fan_root_task(bench_run* run, intptr_t round) {
+    fan_state* state = static_cast< fan_state* >(run->state);
+    state->remaining.store(kFanWidth, memory_order_release);
+    for (int i = 0; i < kFanWidth; ++i) {
+        spawn(run, fan_leaf_task, round);
+    }
+}
+
+size_t fan_max_tasks(size_t scale) {
+    return kFanRounds * scale * (kFanWidth + 2);
+}
+
+void fan_start(bench_run* run, size_t scale) {
+    static fan_state state;
+    state.rounds = kFanRounds * scale;
+    run->state = &state;
+    spawn(run, fan_root_task, 0);
+}
+
+// Deep dependency chain: each task spawns its successor
+enum { kChainLength = 20000 };
+
+void chain_task(bench_run* run, intptr_t remaining) {
+    if (remaining > 1) {
+        spawn(run, chain_task, remaining - 1);
+    }
+}
+
+size_t chain_max_tasks(size_t scale) {
+    return kChainLength * scale;
+}
+
+void chain_start(bench_run* run, size_t scale) {
+    spawn(run, chain_task, kChainLength * scale);
+}
+
+// Imbalanced durations: mostly 1us tasks with a heavy tail of 50us and 500us
+void imbalanced_task(bench_run*, intptr_t duration) {
+    spin_for_ns(duration);
+}
+
+size_t imbalanced_max_tasks(size_t scale) {
+    return 10000 * scale;
+}
+
+void imbalanced_start(bench_run* run, size_t scale) {
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < imbalanced_max_tasks(scale); ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        uint32_t r = (seed >> 8) % 1000;
+        intptr_t duration = r < 900 ? 1000 : (r < 995 ? 50000 : 500000);
+        spawn(run, imbalanced_task, duration);
+    }
+}
+
+workload const g_workloads[] = {
+    { "empty", empty_max_tasks, empty_start },
+    { "fib", fib_max_tasks, fib_start },
+    { "mandelbrot", mandelbrot_max_tasks, mandelbrot_start },
+    { "fan_out_in", fan_max_tasks, fan_start },
+    { "chain", chain_max_tasks, chain_start },
+    { "imbalanced", imbalanced_max_tasks, imbalanced_start },
+};
+
+//============================================================================
+// Schedulers
+//============================================================================
+enum { kMaxTasks = 1 << 18 };
+
+template< typename Scheduler >
+Scheduler* make_scheduler(size_t threads) {
+    return new Scheduler(threads);
+}
+
+template<>
+task_manager* make_scheduler< task_manager >(size_t threads) {
+    return new task_manager(kMaxTasks, threads);
+}
+
+template<>
+task_distributing_scheduler* make_scheduler< task_distributing_scheduler >(size_t threads) {
+    return new task_distributing_scheduler(kMaxTasks, threads);
+}
+
+template<>
+unbounded_task_distributing_scheduler* make_scheduler< unbounded_task_distributing_scheduler >(size_t threads) {
+    return new unbounded_task_distributing_scheduler(1024, threads);
+}
+
+// task_distributing_scheduler routing through per-worker inboxes, a type of
+// its own so run_scheduler can tell it from the shared queue mode
+struct distributor_thread_scheduler : task_distributing_scheduler
+{
+    distributor_thread_scheduler(size_t threads)
+    : task_distributing_scheduler(kMaxTasks, threads, kDistributorThread) {
+    }
+};
+
+template< typename Scheduler >
+Scheduler* make_scheduler(size_t threads, scheduler_settings const& settings);
+
+template<>
+task_manager* make_scheduler< task_manager >(size_t threads, scheduler_settings const& settings) {
+    return new task_manager(kMaxTasks, threads, settings);
+}
+
+template<>
+task_distributing_scheduler* make_scheduler< task_distributing_scheduler >(size_t threads, scheduler_settings const& settings) {
+    return new task_distributing_scheduler(kMaxTasks, threads, kSharedQueue, settings);
+}
+
+template<>
+work_stealing_scheduler* make_scheduler< work_stealing_scheduler >(size_t threads, scheduler_settings const& settings) {
+    return new work_stealing_scheduler(threads, settings);
+}
+
+template< typename Scheduler >
+void submit_to(void* scheduler, task_function func, void* context) {
+    static_cast< Scheduler* >(scheduler)->submit_task(func, context);
+}
+
+template<>
+void submit_to< task_manager >(void* scheduler, task_function func, void* context) {
+    static_cast< task_manager* >(scheduler)->add(func, context);
+}
+
+//============================================================================
+// Reporting
+//============================================================================
+struct bench_result
+{
+    std::string scheduler;
+    std::string workload;
+    size_t threads;
+    size_t tasks;
+    double seconds;
+    uint64_t p50, p99, p999;
+};
+
+uint64_t percentile(std::vector< uint64_t > const& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    size_t index = static_cast< size_t >(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+template< typename Scheduler >
+void run_scheduler(char const* name, size_t threads, size_t reps, size_t scale, std::vector< bench_result >& results) {
+    Scheduler* scheduler = make_scheduler< Scheduler >(threads);
+    uint8_t* image = new uint8_t[kMandelbrotSize * kMandelbrotSize];
+    for (size_t w = 0; w < sizeof(g_workloads) / sizeof(g_workloads[0]); ++w) {
+        workload const& load = g_workloads[w];
+        std::vector< bench_result > reps_results;
+        // one untimed warm up rep
+        for (size_t rep = 0; rep < reps + 1; ++rep) {
+            bench_run run;
+            run.records.resize(load.max_tasks(scale));
+            run.next_record.store(0, memory_order_relaxed);
+            run.outstanding.store(0, memory_order_relaxed);
+            run.submit = submit_to< Scheduler >;
+            run.scheduler = scheduler;
+            run.state = image;
+
+            uint64_t start = now_ns();
+            load.start(&run, scale);
+            wait_for_run(&run);
+            uint64_t end = now_ns();
+            if (rep == 0) {
+                continue;
+            }
+
+            size_t tasks = run.next_record.load(memory_order_acquire);
+            std::vector< uint64_t > latencies(tasks);
+            for (size_t i = 0; i < tasks; ++i) {
+                latencies[i] = run.records[i].latency;
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+            bench_result result;
+            result.scheduler = name;
+            result.workload = load.name;
+            result.threads = threads;
+            result.tasks = tasks;
+            result.seconds = (end - start) / 1e9;
+            result.p50 = percentile(latencies, 0.50);
+            result.p99 = percentile(latencies, 0.99);
+            result.p999 = percentile(latencies, 0.999);
+            reps_results.push_back(result);
+        }
+
+        // keep the median rep by wall time
+        for (size_t i = 1; i < reps_results.size(); ++i) {
+            for (size_t j = i; j > 0 && reps_results[j].seconds < reps_results[j - 1].seconds; --j) {
+                std::swap(reps_results[j], reps_results[j - 1]);
+            }
+        }
+
+        bench_result const& median = reps_results[reps_results.size() / 2];
+        fprintf(stderr, "%-30s threads %2zu %-12s %12.0f tasks/s  p50 %8llu ns  p99 %8llu ns  p999 %8llu ns\n",
+                name, threads, load.name, median.tasks / median.seconds,
+                (unsigned long long)median.p50, (unsigned long long)median.p99, (unsigned long long)median.p999);
+        results.push_back(median);
+    }
+
+    delete [] image;
+    delete scheduler;
+}
+
+//============================================================================
+// Priorities
+//============================================================================
+enum { kCriticalTasks = 200, kCriticalIntervalNs = 250000 };
+enum { kBackgroundTaskNs = 5000, kBackgroundTasksPerThread = 10000 };
+
+struct priority_run;
+
+struct critical_record
+{
+    priority_run* run;
+    uint64_t submitted;
+    uint64_t latency;
+};
+
+struct priority_run
+{
+    atomic< size_t > outstanding;
+    critical_record critical[kCriticalTasks];
+};
+
+void background_task(void* data) {
+    spin_for_ns(kBackgroundTaskNs);
+    --(static_cast< priority_run* >(data)->outstanding);
+}
+
+void critical_task(void* data) {
+    critical_record* record = static_cast< critical_record* >(data);
+    record->latency = now_ns() - record->submitted;
+    --(record->run->outstanding);
+}
+
+bench_result run_priority_rep(task_manager& manager, bool prioritize, size_t background) {
+    priority_run run;
+    run.outstanding.store(background + kCriticalTasks, memory_order_relaxed);
+    task_priority background_priority = prioritize ? kPriorityBackground : kPriorityNormal;
+    task_priority critical_priority = prioritize ? kPriorityHigh : kPriorityNormal;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < background; ++i) {
+        manager.add(background_task, &run, background_priority);
+    }
+
+    // The backlog takes far longer than the trickle, so every critical task
+    // competes with it
+    uint64_t trickle = now_ns();
+    for (size_t i = 0; i < kCriticalTasks; ++i) {
+        while (now_ns() < trickle + i * kCriticalIntervalNs) {
+            active_pause();
+        }
+
+        run.critical[i].run = &run;
+        run.critical[i].submitted = now_ns();
+        manager.add(critical_task, &run.critical[i], critical_priority);
+    }
+
+    while (run.outstanding.load(memory_order_acquire) != 0) {
+        thread::yield();
+    }
+
+    uint64_t end = now_ns();
+    std::vector< uint64_t > latencies(kCriticalTasks);
+    for (size_t i = 0; i < kCriticalTasks; ++i) {
+        latencies[i] = run.critical[i].latency;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    bench_result result;
+    result.scheduler = "task_manager";
+    result.workload = prioritize ? "critical_path_prioritized" : "critical_path";
+    result.threads = manager.num_workers();
+    result.tasks = background + kCriticalTasks;
+    result.seconds = (end - start) / 1e9;
+    result.p50 = percentile(latencies, 0.50);
+    result.p99 = percentile(latencies, 0.99);
+    result.p999 = percentile(latencies, 0.999);
+    return result;
+}
+
+void run_priorities(size_t threads, size_t reps, size_t scale, std::vector< bench_result >& results) {
+    task_manager manager(kMaxTasks, threads);
+    size_t background = std::min< size_t >(kBackgroundTasksPerThread * threads * scale, kMaxTasks - kCriticalTasks - 1);
+    for (int prioritize = 0; prioritize < 2; ++prioritize) {
+        std::vector< bench_result > reps_results;
+        for (size_t rep = 0; rep < reps; ++rep) {
+            reps_results.push_back(run_priority_rep(manager, prioritize != 0, background));
+        }
+
+        // keep the median rep by critical task p99
+        for (size_t i = 1; i < reps_results.size(); ++i) {
+            for (size_t j = i; j > 0 && reps_results[j].p99 < reps_results[j - 1].p99; --j) {
+                std::swap(reps_results[j], reps_results[j - 1]);
+            }
+        }
+
+        bench_result const& median = reps_results[reps_results.size() / 2];
+        fprintf(stderr, "%-30s threads %2zu %-26s critical p50 %10llu ns  p99 %10llu ns  p999 %10llu ns\n",
+                median.scheduler.c_str(), threads, median.workload.c_str(),
+                (unsigned long long)median.p50, (unsigned long long)median.p99, (unsigned long long)median.p999);
+        results.push_back(median);
+    }
+}
+
+//============================================================================
+// Latency
+//============================================================================
+enum { kLatencyRounds = 2000, kLatencyGapNs = 200000, kShortChainLength = 8 };
+
+struct latency_run
+{
+    void (*submit)(void* scheduler, task_function func, void* context);
+    void* scheduler;
+    int remaining;              // only touched by the chain, one task at a time
+    atomic< uint32_t > done;
+};
+
+void latency_task(void* data) {
+    latency_run* run = static_cast< latency_run* >(data);
+    if (--run->remaining > 0) {
+        run->submit(run->scheduler, latency_task, run);
+        return;
+    }
+
+    run->done.store(1, memory_order_release);
+}
+
+template< typename Scheduler >
+bench_result run_latency_rep(Scheduler* scheduler, char const* name, char const* workload, size_t threads, int length) {
+    latency_run run;
+    run.submit = submit_to< Scheduler >;
+    run.scheduler = scheduler;
+    std::vector< uint64_t > latencies;
+    uint64_t start = now_ns();
+    for (size_t round = 0; round < kLatencyRounds; ++round) {
+        spin_for_ns(kLatencyGapNs);
+        run.remaining = length;
+        run.done.store(0, memory_order_relaxed);
+        uint64_t submitted = now_ns();
+        run.submit(scheduler, latency_task, &run);
+        // yields after a while in case the workers share our cpu
+        internal::idle_backoff backoff(internal::kIdleSpinCount, scheduler_settings::kNoLimit);
+        while (run.done.load(memory_order_acquire) == 0) {
+            backoff.idle();
+        }
+
+        latencies.push_back(now_ns() - submitted);
+    }
+
+    uint64_t end = now_ns();
+    std::sort(latencies.begin(), latencies.end());
+    bench_result result;
+    result.scheduler = name;
+    result.workload = workload;
+    result.threads = threads;
+    result.tasks = kLatencyRounds * length;
+    result.seconds = (end - start) / 1e9;
+    result.p50 = percentile(latencies, 0.50);
+    result.p99 = percentile(latencies, 0.99);
+    result.p999 = percentile(latencies, 0.999);
+    return result;
+}
+
+template< typename Scheduler >
+void run_latency(char const* name, size_t threads, size_t reps, std::vector< bench_result >& results) {
+    for (int spinning = 0; spinning < 2; ++spinning) {
+        scheduler_settings settings = spinning ? scheduler_settings::low_latency(threads) : scheduler_settings();
+        Scheduler* scheduler = make_scheduler< Scheduler >(threads, settings);
+        std::string row = std::string(name) + (spinning ? "_spinning" : "");
+        for (int chain = 0; chain < 2; ++chain) {
+            std::vector< bench_result > reps_results;
+            for (size_t rep = 0; rep < reps; ++rep) {
+                reps_results.push_back(run_latency_rep(scheduler, row.c_str(), chain ? "short_chain" : "ping_pong", threads, chain ? kShortChainLength : 1));
+            }
+
+            // keep the median rep by p99
+            for (size_t i = 1; i < reps_results.size(); ++i) {
+                for (size_t j = i; j > 0 && reps_results[j].p99 < reps_results[j - 1].p99; --j) {
+                    std::swap(reps_results[j], reps_results[j - 1]);
+                }
+            }
+
+            bench_result const& median = reps_results[reps_results.size() / 2];
+            fprintf(stderr, "%-39s threads %2zu %-11s p50 %8llu ns  p99 %8llu ns  p999 %8llu ns\n",
+                    median.scheduler.c_str(), threads, median.workload.c_str(),
+                    (unsigned long long)median.p50, (unsigned long long)median.p99, (unsigned long long)median.p999);
+            results.push_back(median);
+        }
+
+        delete scheduler;
+    }
+}
+
+void run_latencies(size_t threads, size_t reps, std::vector< bench_result >& results) {
+    run_latency< task_manager >("task_manager", threads, reps, results);
+    run_latency< task_distributing_scheduler >("task_distributing_scheduler", threads, reps, results);
+    run_latency< work_stealing_scheduler >("work_stealing_scheduler", threads, reps, results);
+}
+
+//============================================================================
+// Frames
+//============================================================================
+enum { kFrameNodes = 1 << 14, kFrames = 64 };
+
+void frame_task(void*) {
+}
+
+void frame_node(void*, int32_t) {
+}
+
+bench_result run_frame_rep(task_manager& manager, task_graph* graph, size_t nodes) {
+    std::vector< uint64_t > frame_ns;
+    uint64_t start = now_ns();
+    for (size_t frame = 0; frame < kFrames; ++frame) {
+        uint64_t frame_start = now_ns();
+        if (graph != 0) {
+            manager.launch(*graph, 0);
+            manager.wait(*graph);
+        }
+        else {
+            task_id parent = manager.begin_add(frame_task, 0);
+            for (size_t i = 0; i < nodes; ++i) {
+                task_id child = manager.begin_add(frame_task, 0);
+                manager.add_child(parent, child);
+                manager.end_add(child);
+            }
+
+            manager.end_add(parent);
+            manager.wait(parent);
+        }
+
+        frame_ns.push_back(now_ns() - frame_start);
+    }
+
+    uint64_t end = now_ns();
+    std::sort(frame_ns.begin(), frame_ns.end());
+    bench_result result;
+    result.scheduler = "task_manager";
+    result.workload = graph != 0 ? "frame_graph" : "frame_rebuild";
+    result.threads = manager.num_workers();
+    result.tasks = nodes * kFrames;
+    result.seconds = (end - start) / 1e9;
+    result.p50 = percentile(frame_ns, 0.50);
+    result.p99 = percentile(frame_ns, 0.99);
+    result.p999 = percentile(frame_ns, 0.999);
+    return result;
+}
+
+void run_frames(size_t threads, size_t reps, size_t scale, std::vector< bench_result >& results) {
+    size_t nodes = std::min< size_t >(kFrameNodes * scale, kMaxTasks - 1);
+    task_manager manager(kMaxTasks, threads);
+    task_graph graph;
+    for (size_t i = 0; i < nodes; ++i) {
+        graph.add_node(frame_node);
+    }
+
+    graph.build();
+    for (int prebuilt = 0; prebuilt < 2; ++prebuilt) {
+        std::vector< bench_result > reps_results;
+        // one untimed warm up rep
+        for (size_t rep = 0; rep < reps + 1; ++rep) {
+            bench_result result = run_frame_rep(manager, prebuilt ? &graph : 0, nodes);
+            if (rep != 0) {
+                reps_results.push_back(result);
+            }
+        }
+
+        // keep the median rep by wall time
+        for (size_t i = 1; i < reps_results.size(); ++i) {
+            for (size_t j = i; j > 0 && reps_results[j].seconds < reps_results[j - 1].seconds; --j) {
+                std::swap(reps_results[j], reps_results[j - 1]);
+            }
+        }
+
+        bench_result const& median = reps_results[reps_results.size() / 2];
+        fprintf(stderr, "%-30s threads %2zu %-14s %12.0f tasks/s  frame p50 %9llu ns  p99 %9llu ns\n",
+                median.scheduler.c_str(), threads, median.workload.c_str(), median.tasks / median.seconds,
+                (unsigned long long)median.p50, (unsigned long long)median.p99);
+        results.push_back(median);
+    }
+}
+
+//============================================================================
+// Queue microbenchmarks
+//============================================================================
+enum { kQueueSize = 1024, kQueueBatch = 1024, kQueueElements = 1 << 22 };
+
+bench_result queue_result(char const* workload, size_t threads, size_t elements, uint64_t start, uint64_t end, std::vector< uint64_t >& batch_ns) {
+    std::sort(batch_ns.begin(), batch_ns.end());
+    bench_result result;
+    result.scheduler = "mpmc_bounded_queue";
+    result.workload = workload;
+    result.threads = threads;
+    result.tasks = elements;
+    result.seconds = (end - start) / 1e9;
+    result.p50 = percentile(batch_ns, 0.50) / kQueueBatch;
+    result.p99 = percentile(batch_ns, 0.99) / kQueueBatch;
+    result.p999 = percentile(batch_ns, 0.999) / kQueueBatch;
+    return result;
+}
+
+bench_result run_queue_pairs(size_t elements) {
+    mpmc_bounded_queue< size_t > queue(kQueueSize);
+    std::vector< uint64_t > batch_ns;
+    size_t sum = 0;
+    uint64_t start = now_ns();
+    for (size_t done = 0; done < elements; done += kQueueBatch) {
+        uint64_t batch_start = now_ns();
+        for (size_t i = 0; i < kQueueBatch; ++i) {
+            size_t value = 0;
+            queue.enqueue(done + i);
+            queue.dequeue(value);
+            sum += value;
+        }
+
+        batch_ns.push_back(now_ns() - batch_start);
+    }
+
+    uint64_t end = now_ns();
+    assert(sum == elements * (elements - 1) / 2);
+    return queue_result("enqueue_dequeue", 1, elements, start, end, batch_ns);
+}
+
+bench_result run_queue_bulk(size_t elements) {
+    enum { kBulk = 8 };
+    mpmc_bounded_queue< size_t > queue(kQueueSize);
+    std::vector< uint64_t > batch_ns;
+    size_t in[kBulk], out[kBulk];
+    uint64_t start = now_ns();
+    for (size_t done = 0; done < elements; done += kQueueBatch) {
+        uint64_t batch_start = now_ns();
+        for (size_t i = 0; i < kQueueBatch; i += kBulk) {
+            for (size_t j = 0; j < kBulk; ++j) {
+                in[j] = done + i + j;
+            }
+
+            queue.enqueue_bulk(in, kBulk);
+            queue.dequeue_bulk(out, kBulk);
+        }
+
+        batch_ns.push_back(now_ns() - batch_start);
+    }
+
+    uint64_t end = now_ns();
+    return queue_result("bulk_8", 1, elements, start, end, batch_ns);
+}
+
+struct queue_producer
+{
+    mpmc_bounded_queue< size_t >* queue;
+    size_t elements;
+};
+
+void queue_producer_func(void* data) {
+    queue_producer* producer = static_cast< queue_producer* >(data);
+    for (size_t i = 0; i < producer->elements; ++i) {
+        while (!producer->queue->enqueue(i)) {
+            thread::yield();
+        }
+    }
+}
+
+bench_result run_queue_producer_consumer(size_t elements) {
+    mpmc_bounded_queue< size_t > queue(kQueueSize);
+    queue_producer producer = { &queue, elements };
+    std::vector< uint64_t > batch_ns;
+    thread producer_thread(queue_producer_func);
+    uint64_t start = now_ns();
+    producer_thread.start(&producer);
+    size_t received = 0;
+    uint64_t batch_start = start;
+    while (received < elements) {
+        size_t value = 0;
+        // yield rather than spin, in case the two threads share a cpu
+        if (!queue.dequeue(value)) {
+            thread::yield();
+            continue;
+        }
+
+        assert(value == received);
+        if (++received % kQueueBatch == 0) {
+            uint64_t now = now_ns();
+            batch_ns.push_back(now - batch_start);
+            batch_start = now;
+        }
+    }
+
+    uint64_t end = now_ns();
+    producer_thread.join();
+    return queue_result("producer_consumer", 2, elements, start, end, batch_ns);
+}
+
+void run_queue_benchmarks(size_t reps, size_t scale, std::vector< bench_result >& results) {
+    size_t elements = kQueueElements * scale;
+    for (int workload = 0; workload < 3; ++workload) {
+        std::vector< bench_result > reps_results;
+        for (size_t rep = 0; rep < reps; ++rep) {
+            if (workload == 0) {
+                reps_results.push_back(run_queue_pairs(elements));
+            }
+            else if (workload == 1) {
+                reps_results.push_back(run_queue_bulk(elements));
+            }
+            else {
+                reps_results.push_back(run_queue_producer_consumer(elements / 4));
+            }
+        }
+
+        // keep the median rep by wall time
+        for (size_t i = 1; i < reps_results.size(); ++i) {
+            for (size_t j = i; j > 0 && reps_results[j].seconds < reps_results[j - 1].seconds; --j) {
+                std::swap(reps_results[j], reps_results[j - 1]);
+            }
+        }
+
+        bench_result const& median = reps_results[reps_results.size() / 2];
+        fprintf(stderr, "%-30s threads %2zu %-17s %8.2f ns/element  p50 %4llu ns  p99 %4llu ns  p999 %4llu ns\n",
+                median.scheduler.c_str(), median.threads, median.workload.c_str(), median.seconds * 1e9 / median.tasks,
+                (unsigned long long)median.p50, (unsigned long long)median.p99, (unsigned long long)median.p999);
+        results.push_back(median);
+    }
+}
+
+void write_json(FILE* out, std::vector< bench_result > const& results, size_t reps, size_t scale) {
+    fprintf(out, "{\n  \"cores\": %d,\n  \"reps\": %zu,\n  \"scale\": %zu,\n  \"results\": [\n", internal::number_of_cores(), reps, scale);
+    for (size_t i = 0; i < results.size(); ++i) {
+        bench_result const& r = results[i];
+        fprintf(out, "    { \"scheduler\": \"%s\", \"workload\": \"%s\", \"threads\": %zu, \"tasks\": %zu, "
+                     "\"seconds\": %.6f, \"throughput\": %.1f, "
+                     "\"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu } }%s\n",
+                r.scheduler.c_str(), r.workload.c_str(), r.threads, r.tasks, r.seconds, r.tasks / r.seconds,
+                (unsigned long long)r.p50, (unsigned long long)r.p99, (unsigned long long)r.p999,
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+std::vector< size_t > default_thread_counts() {
+    std::vector< size_t > counts;
+    size_t cores = internal::number_of_cores();
+    for (size_t n = 1; n < cores; n *= 2) {
+        counts.push_back(n);
+    }
+
+    counts.push_back(cores);
+    return counts;
+}
+
+std::vector< size_t > parse_thread_counts(char const* list) {
+    std::vector< size_t > counts;
+    char const* p = list;
+    while (*p) {
+        char* end = 0;
+        long n = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+
+        if (n > 0) {
+            counts.push_back(static_cast< size_t >(n));
+        }
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return counts;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector< size_t > threads = default_thread_counts();
+    size_t reps = 3;
+    size_t scale = 1;
+    char const* out_path = 0;
+    bool queues_only = false;
+    bool latency_only = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = parse_thread_counts(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = std::max(atoi(argv[++i]), 1);
+        }
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::max(atoi(argv[++i]), 1);
+        }
+        else if (strcmp(argv[i], "--quick") == 0) {
+            reps = 1;
+        }
+        else if (strcmp(argv[i], "--queues") == 0) {
+            queues_only = true;
+        }
+        else if (strcmp(argv[i], "--latency") == 0) {
+            latency_only = true;
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+        else {
+            fprintf(stderr, "usage: %s [--threads 1,2,4] [--reps n] [--scale n] [--quick] [--queues] [--latency] [--out file.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector< bench_result > results;
+    if (!latency_only) {
+        run_queue_benchmarks(reps, scale, results);
+    }
+    
+    for (size_t i = 0; i < threads.size() && latency_only; ++i) {
+        run_latencies(threads[i], reps, results);
+    }
+    
+    for (size_t i = 0; i < threads.size() && !queues_only && !latency_only; ++i) {
+        run_scheduler< task_manager >("task_manager", threads[i], reps, scale, results);
+        run_scheduler< task_distributing_scheduler >("task_distributing_scheduler", threads[i], reps, scale, results);
+        run_scheduler< distributor_thread_scheduler >("task_distributing_scheduler_distributor", threads[i], reps, scale, results);
+        run_scheduler< unbounded_task_distributing_scheduler >("unbounded_task_distributing_scheduler", threads[i], reps, scale, results);
+        run_scheduler< work_stealing_lock_scheduler >("work_stealing_lock_scheduler", threads[i], reps, scale, results);
+        run_scheduler< work_stealing_scheduler >("work_stealing_scheduler", threads[i], reps, scale, results);
+        run_priorities(threads[i], reps, scale, results);
+        run_frames(threads[i], reps, scale, results);
+        run_latencies(threads[i], reps, results);
+    }
+
+    FILE* out = stdout;
+    if (out_path != 0) {
+        out = fopen(out_path, "w");
+        if (out == 0) {
+            fprintf(stderr, "couldn't open %s\n", out_path);
+            return 1;
+        }
+    }
+
+    write_json(out, results, reps, scale);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
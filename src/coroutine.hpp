@@ -0,0 +1,485 @@
+/*
+ *  coroutine.hpp
+ *  Task Scheduler
+ *
+ */
+
+// C++20 coroutine support, compiled only when the compiler and library
+// provide <coroutine> (TASK_SCHEDULER_HAS_COROUTINES is then 1).
+//
+// task<T> is a lazily started coroutine returning T. Awaiting a task starts
+// it on the awaiting thread and suspends the awaiter until the task returns,
+// at which point the awaiter is resumed directly by whichever worker ran the
+// task to completion, without going through a queue and without blocking
+// a thread while it waits.
+//
+//   task< int > leaf(work_stealing_scheduler& scheduler, int value) {
+//       co_await scheduler.schedule();  // continue on a worker
+//       co_return value * 2;
+//   }
+//
+//   task< int > root(work_stealing_scheduler& scheduler) {
+//       task< int > a = leaf(scheduler, 1), b = leaf(scheduler, 2);
+//       co_await when_all(a, b);        // a and b run in parallel
+//       co_return co_await a + co_await b;
+//   }
+//
+//   int result = sync_wait(root(scheduler));
+//
+// schedule_operation works with any scheduler that has submit_task(F); the
+// resumption is an 8 byte task_closure, so it goes on the local deque of the
+// submitting worker without allocating. Exceptions aren't supported, an
+// exception escaping a coroutine terminates.
+
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define TASK_SCHEDULER_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifndef TASK_SCHEDULER_HAS_COROUTINES
+#define TASK_SCHEDULER_HAS_COROUTINES 0
+#endif
+
+#if TASK_SCHEDULER_HAS_COROUTINES
+
+#include "atomic.hpp"
+#include "event_count.hpp"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+template< typename T = void >
+class task;
+
+namespace internal
+{
+    struct task_promise_base
+    {
+        struct final_awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+
+            template< typename Promise >
+            std::coroutine_handle<> await_suspend(std::coroutine_handle< Promise > finished) noexcept {
+                std::coroutine_handle<> continuation = finished.promise().continuation_;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+
+        final_awaiter final_suspend() const noexcept { return {}; }
+
+        void unhandled_exception() const noexcept { std::terminate(); }
+
+        std::coroutine_handle<> continuation_;
+    };
+
+    template< typename T >
+    struct task_promise : task_promise_base
+    {
+        task< T > get_return_object() noexcept;
+
+        template< typename U >
+        void return_value(U&& value) { value_.emplace(std::forward< U >(value)); }
+
+        T& result() & { return *value_; }
+
+        T&& result() && { return std::move(*value_); }
+
+        std::optional< T > value_;
+    };
+
+    template<>
+    struct task_promise< void > : task_promise_base
+    {
+        task< void > get_return_object() noexcept;
+
+        void return_void() const noexcept {}
+
+        void result() const noexcept {}
+    };
+
+    // Resumes a suspended coroutine, as a task_closure it's stored inline
+    struct resume_coroutine
+    {
+        std::coroutine_handle<> handle;
+
+        void operator()() const { handle.resume(); }
+    };
+}
+
+template< typename T >
+class task
+{
+public:
+
+    typedef internal::task_promise< T > promise_type;
+    typedef std::coroutine_handle< promise_type > handle_type;
+
+private:
+
+    template< bool Move >
+    struct awaiter
+    {
+        handle_type handle;
+
+        bool await_ready() const noexcept { return !handle || handle.done(); }
+
+        // Starts the task, symmetric transfer keeps the stack flat
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation_ = awaiting;
+            return handle;
+        }
+
+        decltype(auto) await_resume() {
+            if constexpr (Move) {
+                return std::move(handle.promise()).result();
+            }
+            else {
+                return handle.promise().result();
+            }
+        }
+    };
+
+public:
+
+    task() noexcept
+    : handle_(nullptr) {
+    }
+
+    explicit task(handle_type handle) noexcept
+    : handle_(handle) {
+    }
+
+    task(task&& other) noexcept
+    : handle_(std::exchange(other.handle_, nullptr)) {
+    }
+
+    task& operator=(task&& other) noexcept {
+        if (this != &other) {
+            destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+
+        return *this;
+    }
+
+    // A task may only be destroyed before it starts or after it finishes
+    ~task() {
+        destroy();
+    }
+
+    task(task const&) = delete;
+    task& operator=(task const&) = delete;
+
+    bool is_ready() const noexcept { return !handle_ || handle_.done(); }
+
+    // Only valid once the task has finished
+    decltype(auto) result() & { return handle_.promise().result(); }
+
+    decltype(auto) result() && { return std::move(handle_.promise()).result(); }
+
+    // Awaiting an lvalue leaves the result in the task, so a task awaited
+    // through when_all can be awaited again to read it
+    awaiter< false > operator co_await() & noexcept { return awaiter< false >{ handle_ }; }
+
+    awaiter< true > operator co_await() && noexcept { return awaiter< true >{ handle_ }; }
+
+private:
+
+    void destroy() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+private:
+
+    handle_type handle_;
+};
+
+template< typename T >
+inline task< T > internal::task_promise< T >::get_return_object() noexcept {
+    return task< T >(std::coroutine_handle< task_promise< T > >::from_promise(*this));
+}
+
+inline task< void > internal::task_promise< void >::get_return_object() noexcept {
+    return task< void >(std::coroutine_handle< task_promise< void > >::from_promise(*this));
+}
+
+// co_await scheduler.schedule() suspends the coroutine and submits its
+// resumption to the scheduler
+template< typename Scheduler >
+class schedule_operation
+{
+public:
+
+    explicit schedule_operation(Scheduler& scheduler) noexcept
+    : scheduler_(scheduler) {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        internal::resume_coroutine resume = { awaiting };
+        scheduler_.submit_task(resume);
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+
+    Scheduler& scheduler_;
+};
+
+//============================================================================
+// when_all
+//============================================================================
+namespace internal
+{
+    // One count per child plus one for the awaiter, whoever drops it to
+    // zero resumes the awaiting coroutine
+    struct when_all_latch
+    {
+        atomic< size_t > count;
+        std::coroutine_handle<> awaiting;
+
+        bool arrive() noexcept { return count.fetch_sub(1, memory_order_acq_rel) == 1; }
+    };
+
+    // Awaits one child of a when_all and then arrives at the latch
+    class when_all_helper
+    {
+    public:
+
+        struct promise_type
+        {
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                // The awaiter may destroy this frame as soon as we've
+                // arrived, so only locals are touched after that
+                std::coroutine_handle<> await_suspend(std::coroutine_handle< promise_type > finished) noexcept {
+                    when_all_latch* latch = finished.promise().latch_;
+                    std::coroutine_handle<> awaiting = latch->awaiting;
+                    return latch->arrive() ? awaiting : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            when_all_helper get_return_object() noexcept {
+                return when_all_helper(std::coroutine_handle< promise_type >::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+
+            final_awaiter final_suspend() const noexcept { return {}; }
+
+            void return_void() const noexcept {}
+
+            void unhandled_exception() const noexcept { std::terminate(); }
+
+            when_all_latch* latch_;
+        };
+
+    public:
+
+        explicit when_all_helper(std::coroutine_handle< promise_type > handle) noexcept
+        : handle_(handle) {
+        }
+
+        when_all_helper(when_all_helper&& other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)) {
+        }
+
+        ~when_all_helper() {
+            if (handle_) {
+                handle_.destroy();
+            }
+        }
+
+        when_all_helper(when_all_helper const&) = delete;
+        when_all_helper& operator=(when_all_helper const&) = delete;
+
+        void start(when_all_latch* latch) {
+            handle_.promise().latch_ = latch;
+            handle_.resume();
+        }
+
+    private:
+
+        std::coroutine_handle< promise_type > handle_;
+    };
+
+    template< typename T >
+    inline when_all_helper make_when_all_helper(task< T >& child) {
+        co_await child;
+    }
+}
+
+class when_all_operation
+{
+public:
+
+    explicit when_all_operation(std::vector< internal::when_all_helper >&& helpers) noexcept
+    : helpers_(std::move(helpers)) {
+    }
+
+    when_all_operation(when_all_operation const&) = delete;
+    when_all_operation& operator=(when_all_operation const&) = delete;
+
+    bool await_ready() const noexcept { return helpers_.empty(); }
+
+    // Starts every child in turn on this thread. Children that begin with
+    // co_await schedule() hand themselves to the workers straight away, so
+    // they run in parallel. Doesn't suspend if they've all finished already.
+    bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        latch_.count.store(helpers_.size() + 1, memory_order_relaxed);
+        latch_.awaiting = awaiting;
+        for (size_t i = 0; i < helpers_.size(); ++i) {
+            helpers_[i].start(&latch_);
+        }
+
+        return !latch_.arrive();
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+
+    internal::when_all_latch latch_;
+    std::vector< internal::when_all_helper > helpers_;
+};
+
+// Waits for all of the tasks to finish. Their results stay in the tasks,
+// co_await each one afterwards to read it.
+template< typename... Ts >
+inline when_all_operation when_all(task< Ts >&... tasks) {
+    std::vector< internal::when_all_helper > helpers;
+    helpers.reserve(sizeof...(Ts));
+    (helpers.push_back(internal::make_when_all_helper(tasks)), ...);
+    return when_all_operation(std::move(helpers));
+}
+
+template< typename T >
+inline when_all_operation when_all(std::vector< task< T > >& tasks) {
+    std::vector< internal::when_all_helper > helpers;
+    helpers.reserve(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        helpers.push_back(internal::make_when_all_helper(tasks[i]));
+    }
+
+    return when_all_operation(std::move(helpers));
+}
+
+//============================================================================
+// sync_wait
+//============================================================================
+namespace internal
+{
+    // Shared by every sync_wait, waiters recheck their own flag on wake up
+    inline event_count& sync_wait_event() {
+        static event_count event;
+        return event;
+    }
+
+    class sync_wait_helper
+    {
+    public:
+
+        struct promise_type
+        {
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                // The waiter may destroy this frame as soon as done is set
+                void await_suspend(std::coroutine_handle< promise_type > finished) noexcept {
+                    event_count& event = sync_wait_event();
+                    finished.promise().done_.store(1, memory_order_release);
+                    event.notify_all();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            sync_wait_helper get_return_object() noexcept {
+                return sync_wait_helper(std::coroutine_handle< promise_type >::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+
+            final_awaiter final_suspend() const noexcept { return {}; }
+
+            void return_void() const noexcept {}
+
+            void unhandled_exception() const noexcept { std::terminate(); }
+
+            atomic< int > done_;
+        };
+
+    public:
+
+        explicit sync_wait_helper(std::coroutine_handle< promise_type > handle) noexcept
+        : handle_(handle) {
+            handle_.promise().done_.store(0, memory_order_relaxed);
+        }
+
+        ~sync_wait_helper() {
+            handle_.destroy();
+        }
+
+        sync_wait_helper(sync_wait_helper const&) = delete;
+        sync_wait_helper& operator=(sync_wait_helper const&) = delete;
+
+        void run() {
+            handle_.resume();
+            event_count& event = sync_wait_event();
+            while (handle_.promise().done_.load(memory_order_acquire) == 0) {
+                event_count::key key = event.prepare_wait();
+                if (handle_.promise().done_.load(memory_order_acquire) != 0) {
+                    event.cancel_wait();
+                    break;
+                }
+
+                event.wait(key);
+            }
+        }
+
+    private:
+
+        std::coroutine_handle< promise_type > handle_;
+    };
+
+    template< typename T >
+    inline sync_wait_helper make_sync_wait_helper(task< T >& waited) {
+        co_await waited;
+    }
+}
+
+// Runs the task and blocks the calling thread, which mustn't be a worker,
+// until it finishes
+template< typename T >
+inline T sync_wait(task< T >&& waited) {
+    {
+        internal::sync_wait_helper helper = internal::make_sync_wait_helper(waited);
+        helper.run();
+    }
+
+    return std::move(waited).result();
+}
+
+#endif // TASK_SCHEDULER_HAS_COROUTINES
+
+#endif // COROUTINE_HPP
@@ -0,0 +1,223 @@
+/*
+ *  event_count.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Event count (after Dmitry Vyukov) used to park idle workers. A worker that
+// runs out of work calls prepare_wait(), checks its queues one last time and
+// then either cancel_wait()s or wait()s on the returned key. Producers call
+// notify_one() after publishing work; that is a fence and a load unless
+// someone is actually parked, in which case the epoch is bumped and a single
+// waiter is woken. It returns whether anyone was waiting. On Linux the
+// waiters sleep on a futex, elsewhere on a condition variable.
+//
+// A waiter may also pass a timeout and a mask: notify(mask) then only wakes
+// those whose mask shares a bit with it, which lets a producer wake one
+// particular thread. Without futexes it wakes every waiter instead.
+
+#ifndef EVENT_COUNT_HPP
+#define EVENT_COUNT_HPP
+
+#include "atomic.hpp"
+#include <limits>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
+class event_count
+{
+public:
+
+    typedef uint32_t key;
+
+public:
+
+    event_count();
+
+    ~event_count();
+
+    key prepare_wait();
+
+    void cancel_wait();
+
+    void wait(key k);
+
+    // timeout_ns of 0 waits for as long as wait(k) does
+    void wait(key k, uint32_t mask, uint64_t timeout_ns);
+
+    bool notify_one();
+
+    void notify_all();
+
+    // Whether anyone was woken
+    bool notify(uint32_t mask);
+
+private:
+
+    event_count(event_count const&);
+    event_count& operator=(event_count const&);
+
+    void wake(int count);
+
+private:
+
+    atomic< uint32_t > epoch_;
+    atomic< uint32_t > waiters_;
+#if !defined(__linux__)
+    pthread_mutex_t mutex_;
+    pthread_cond_t condition_;
+#endif
+};
+
+
+inline event_count::event_count() {
+    epoch_.store(0, memory_order_relaxed);
+    waiters_.store(0, memory_order_relaxed);
+#if !defined(__linux__)
+    pthread_mutex_init(&mutex_, 0);
+    pthread_cond_init(&condition_, 0);
+#endif
+}
+
+inline event_count::~event_count() {
+#if !defined(__linux__)
+    pthread_cond_destroy(&condition_);
+    pthread_mutex_destroy(&mutex_);
+#endif
+}
+
+inline event_count::key event_count::prepare_wait() {
+    // The increment is a full barrier, so the caller's re-check of its
+    // queues can't be reordered before it.
+    ++waiters_;
+    return epoch_.load(memory_order_acquire);
+}
+
+inline void event_count::cancel_wait() {
+    --waiters_;
+}
+
+inline void event_count::wait(event_count::key k) {
+#if defined(__linux__)
+    if (epoch_.load(memory_order_acquire) == k) {
+        syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAIT_PRIVATE, k, 0, 0, 0);
+    }
+#else
+    pthread_mutex_lock(&mutex_);
+    while (epoch_.load(memory_order_acquire) == k) {
+        pthread_cond_wait(&condition_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+#endif
+
+    --waiters_;
+}
+
+inline void event_count::wait(event_count::key k, uint32_t mask, uint64_t timeout_ns) {
+    uint64_t const kNsPerSecond = 1000000000ull;
+#if defined(__linux__)
+    if (epoch_.load(memory_order_acquire) == k) {
+        // The bitset wait takes a deadline on the monotonic clock
+        timespec deadline;
+        timespec* until = 0;
+        if (timeout_ns != 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            uint64_t ns = static_cast< uint64_t >(deadline.tv_nsec) + timeout_ns;
+            deadline.tv_sec += static_cast< time_t >(ns / kNsPerSecond);
+            deadline.tv_nsec = static_cast< long >(ns % kNsPerSecond);
+            until = &deadline;
+        }
+        
+        syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAIT_BITSET_PRIVATE, k, until, 0, mask);
+    }
+#else
+    (void)mask;
+    pthread_mutex_lock(&mutex_);
+    if (timeout_ns == 0) {
+        while (epoch_.load(memory_order_acquire) == k) {
+            pthread_cond_wait(&condition_, &mutex_);
+        }
+    }
+    else {
+        timeval now;
+        gettimeofday(&now, 0);
+        uint64_t ns = static_cast< uint64_t >(now.tv_usec) * 1000 + timeout_ns;
+        timespec deadline;
+        deadline.tv_sec = now.tv_sec + static_cast< time_t >(ns / kNsPerSecond);
+        deadline.tv_nsec = static_cast< long >(ns % kNsPerSecond);
+        while (epoch_.load(memory_order_acquire) == k) {
+            if (pthread_cond_timedwait(&condition_, &mutex_, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&mutex_);
+#endif
+
+    --waiters_;
+}
+
+inline bool event_count::notify_one() {
+    // Pairs with the barrier in prepare_wait: either the waiter sees the
+    // work that was just published, or we see the waiter.
+    memory_barrier();
+    if (waiters_.load(memory_order_relaxed) != 0) {
+        wake(1);
+        return true;
+    }
+    
+    return false;
+}
+
+inline void event_count::notify_all() {
+    memory_barrier();
+    if (waiters_.load(memory_order_relaxed) != 0) {
+        wake(std::numeric_limits< int >::max());
+    }
+}
+
+inline bool event_count::notify(uint32_t mask) {
+    memory_barrier();
+    if (waiters_.load(memory_order_relaxed) == 0) {
+        return false;
+    }
+    
+#if defined(__linux__)
+    ++epoch_;
+    return syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAKE_BITSET_PRIVATE, std::numeric_limits< int >::max(), 0, 0, mask) > 0;
+#else
+    (void)mask;
+    wake(std::numeric_limits< int >::max());
+    return true;
+#endif
+}
+
+inline void event_count::wake(int count) {
+#if defined(__linux__)
+    ++epoch_;
+    syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+#else
+    pthread_mutex_lock(&mutex_);
+    ++epoch_;
+    if (count == 1) {
+        pthread_cond_signal(&condition_);
+    }
+    else {
+        pthread_cond_broadcast(&condition_);
+    }
+    pthread_mutex_unlock(&mutex_);
+#endif
+}
+
+#endif // EVENT_COUNT_HPP
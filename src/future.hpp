@@ -0,0 +1,593 @@
+/*
+ *  future.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Typed results for task_manager tasks.
+//
+//   future< int > a = spawn(manager, compute);
+//   future< double > b = a.then(scale);      // scheduled once a is ready
+//   future< void > both = when_all(a, b);
+//   double result = b.get();                 // runs other tasks meanwhile
+//
+// A future shares a reference counted state with the task producing it. The
+// state holds the value, the continuation and the flags, and comes from
+// internal::closure_pool, so a future whose value fits in a pool block
+// doesn't allocate. Each state has room for one continuation, so a future
+// may be passed to then, when_all or when_any only once. get() helps run
+// ready tasks and parks on the manager's event count, it never just spins.
+//
+// The result of f() (or f(value) for then) is deduced with decltype under
+// C++11. Under C++03 f must be a function pointer or define result_type.
+
+#ifndef FUTURE_HPP
+#define FUTURE_HPP
+
+#include "atomic.hpp"
+#include "task_closure.hpp"
+#include "task_manager.hpp"
+#include <new>
+#include <vector>
+
+#if __cplusplus >= 201103L
+#include <type_traits>
+#include <utility>
+#endif
+
+template< typename T >
+class future;
+
+namespace internal
+{
+    //========================================================================
+    // Result types
+    //========================================================================
+#if __cplusplus >= 201103L
+    template< typename F >
+    struct call_result
+    {
+        typedef typename std::decay< decltype(std::declval< F& >()()) >::type type;
+    };
+
+    template< typename F, typename T >
+    struct continuation_result
+    {
+        typedef typename std::decay< decltype(std::declval< F& >()(std::declval< T& >())) >::type type;
+    };
+#else
+    template< typename F >
+    struct call_result
+    {
+        typedef typename F::result_type type;
+    };
+
+    template< typename R >
+    struct call_result< R (*)() >
+    {
+        typedef R type;
+    };
+
+    template< typename F, typename T >
+    struct continuation_result
+    {
+        typedef typename F::result_type type;
+    };
+
+    template< typename R, typename A, typename T >
+    struct continuation_result< R (*)(A), T >
+    {
+        typedef R type;
+    };
+#endif
+
+    template< typename F >
+    struct continuation_result< F, void >
+    {
+        typedef typename call_result< F >::type type;
+    };
+
+    //========================================================================
+    // Shared state
+    //========================================================================
+    class future_state_base
+    {
+    public:
+
+        enum
+        {
+            kReady = 1,
+            kHasContinuation = 2,
+            kWaiting = 4
+        };
+
+    public:
+
+        explicit future_state_base(task_manager* manager)
+        : manager_(manager) {
+            flags_.store(0, memory_order_relaxed);
+            references_.store(2, memory_order_relaxed);
+        }
+
+        task_manager* manager() const { return manager_; }
+
+        bool ready() const { return (flags_.load(memory_order_acquire) & kReady) != 0; }
+
+        void add_reference() { ++references_; }
+
+        // Runs continuation on the manager once the value is set, or right
+        // away if it already is
+        void set_continuation(task_closure const& continuation, task_priority priority);
+
+        // Runs callback on whichever thread sets the value, or right here if
+        // it already is set. Only for the short internal bookkeeping of
+        // when_all and when_any.
+        void set_callback(task_closure const& callback);
+
+        // Helps the manager run tasks until the value is set
+        void wait();
+
+    protected:
+
+        // Called once the value has been constructed
+        void publish();
+
+        // True if this dropped the last reference
+        bool drop_reference() { return --references_ == 0; }
+
+    private:
+
+        void attach(task_closure const& continuation);
+
+        void run_continuation();
+
+    private:
+
+        struct is_ready
+        {
+            future_state_base const* state;
+
+            bool operator()() const { return state->ready(); }
+        };
+
+    private:
+
+        atomic< uint32_t > flags_;
+        atomic< int32_t > references_;
+        task_manager* const manager_;
+        task_priority continuation_priority_;
+        bool inline_continuation_;
+        task_closure continuation_;
+    };
+
+    template< typename T >
+    class future_state : public future_state_base
+    {
+    public:
+
+        typedef T& reference;
+
+    public:
+
+        // Starts with two references, the producer's and the future's
+        static future_state* create(task_manager* manager) {
+            void* block = closure_pool::instance().allocate(sizeof(future_state));
+            return new (block) future_state(manager);
+        }
+
+        void release() {
+            if (drop_reference()) {
+                this->~future_state();
+                closure_pool::instance().deallocate(this);
+            }
+        }
+
+        void set_value(T const& value) {
+            new (storage_.bytes) T(value);
+            publish();
+        }
+
+#if __cplusplus >= 201103L
+        void set_value(T&& value) {
+            new (storage_.bytes) T(std::move(value));
+            publish();
+        }
+#endif
+
+        T& value() { return *reinterpret_cast< T* >(storage_.bytes); }
+
+    private:
+
+        explicit future_state(task_manager* manager)
+        : future_state_base(manager) {
+        }
+
+        ~future_state() {
+            if (ready()) {
+                value().~T();
+            }
+        }
+
+    private:
+
+        union storage
+        {
+            char bytes[sizeof(T)];
+            void* pointer;
+            double align_double;
+            int64_t align_int64;
+        };
+
+        storage storage_;
+    };
+
+    template<>
+    class future_state< void > : public future_state_base
+    {
+    public:
+
+        typedef void reference;
+
+    public:
+
+        static future_state* create(task_manager* manager) {
+            void* block = closure_pool::instance().allocate(sizeof(future_state));
+            return new (block) future_state(manager);
+        }
+
+        void release() {
+            if (drop_reference()) {
+                this->~future_state();
+                closure_pool::instance().deallocate(this);
+            }
+        }
+
+        void set_value() { publish(); }
+
+        void value() {}
+
+    private:
+
+        explicit future_state(task_manager* manager)
+        : future_state_base(manager) {
+        }
+    };
+
+    //========================================================================
+    // Tasks
+    //========================================================================
+
+    // Stores f() or f(argument) into a state, void results just publish
+    template< typename R >
+    struct set_result
+    {
+        template< typename F >
+        static void call(future_state< R >* state, F& f) { state->set_value(f()); }
+
+        template< typename F, typename A >
+        static void call(future_state< R >* state, F& f, A& argument) { state->set_value(f(argument)); }
+    };
+
+    template<>
+    struct set_result< void >
+    {
+        template< typename F >
+        static void call(future_state< void >* state, F& f) {
+            f();
+            state->set_value();
+        }
+
+        template< typename F, typename A >
+        static void call(future_state< void >* state, F& f, A& argument) {
+            f(argument);
+            state->set_value();
+        }
+    };
+
+    // Calls f with the source's value, or with nothing for a void source
+    template< typename T >
+    struct continue_with
+    {
+        template< typename F, typename R >
+        static void call(future_state< R >* target, F& f, future_state< T >* source) {
+            set_result< R >::call(target, f, source->value());
+        }
+    };
+
+    template<>
+    struct continue_with< void >
+    {
+        template< typename F, typename R >
+        static void call(future_state< R >* target, F& f, future_state< void >*) {
+            set_result< R >::call(target, f);
+        }
+    };
+
+    template< typename F, typename R >
+    struct spawn_task
+    {
+        F func;
+        future_state< R >* state;
+
+        void operator()() {
+            set_result< R >::call(state, func);
+            state->release();
+        }
+    };
+
+    template< typename F, typename T, typename R >
+    struct then_task
+    {
+        F func;
+        future_state< T >* source;
+        future_state< R >* target;
+
+        void operator()() {
+            continue_with< T >::call(target, func, source);
+            source->release();
+            target->release();
+        }
+    };
+
+    // Counts the inputs of when_all down, the last one in sets the result
+    struct when_all_counter
+    {
+        atomic< int32_t > remaining;
+        future_state< void >* target;
+    };
+
+    inline future_state< void >* when_all(future_state_base* const* states, size_t count);
+
+    struct when_all_arrive
+    {
+        when_all_counter* counter;
+
+        void operator()() const {
+            if (--(counter->remaining) == 0) {
+                future_state< void >* target = counter->target;
+                closure_pool::instance().deallocate(counter);
+                target->set_value();
+                target->release();
+            }
+        }
+    };
+
+    // The first input of when_any to arrive claims the result, the last one
+    // frees the selector
+    struct when_any_selector
+    {
+        atomic< int32_t > claimed;
+        atomic< int32_t > remaining;
+        future_state< size_t >* target;
+    };
+
+    struct when_any_arrive
+    {
+        when_any_selector* selector;
+        size_t index;
+
+        void operator()() const {
+            int32_t unclaimed = 0;
+            if (selector->claimed.compare_exchange_strong(unclaimed, 1, memory_order_acq_rel)) {
+                selector->target->set_value(index);
+                selector->target->release();
+            }
+
+            if (--(selector->remaining) == 0) {
+                closure_pool::instance().deallocate(selector);
+            }
+        }
+    };
+}
+
+//============================================================================
+// future
+//============================================================================
+template< typename T >
+class future
+{
+public:
+
+    typedef internal::future_state< T > state_type;
+
+public:
+
+    future()
+    : state_(0) {
+    }
+
+    // Adopts one of state's references
+    explicit future(state_type* state)
+    : state_(state) {
+    }
+
+    future(future const& other)
+    : state_(other.state_) {
+        if (state_ != 0) {
+            state_->add_reference();
+        }
+    }
+
+    future& operator=(future const& other) {
+        if (other.state_ != 0) {
+            other.state_->add_reference();
+        }
+
+        if (state_ != 0) {
+            state_->release();
+        }
+
+        state_ = other.state_;
+        return *this;
+    }
+
+    ~future() {
+        if (state_ != 0) {
+            state_->release();
+        }
+    }
+
+    bool valid() const { return state_ != 0; }
+
+    bool ready() const { return state_->ready(); }
+
+    // Blocks until the value is set, running other tasks meanwhile
+    void wait() const { state_->wait(); }
+
+    typename state_type::reference get() const {
+        state_->wait();
+        return state_->value();
+    }
+
+    // Schedules f(value), or f() for a future< void >, once this is ready
+    template< typename F >
+    future< typename internal::continuation_result< F, T >::type > then(F const& f, task_priority priority = kPriorityNormal) const;
+
+    state_type* state() const { return state_; }
+
+private:
+
+    state_type* state_;
+};
+
+// Runs f() on the manager and returns its result
+template< typename F >
+inline future< typename internal::call_result< F >::type > spawn(task_manager& manager, F const& f, task_priority priority = kPriorityNormal) {
+    typedef typename internal::call_result< F >::type result_type;
+    internal::future_state< result_type >* state = internal::future_state< result_type >::create(&manager);
+    internal::spawn_task< F, result_type > work = { f, state };
+    manager.add(work, priority);
+    return future< result_type >(state);
+}
+
+// Ready once every future in futures is
+template< typename T >
+inline future< void > when_all(std::vector< future< T > > const& futures) {
+    assert(!futures.empty());
+    std::vector< internal::future_state_base* > states;
+    for (size_t i = 0; i < futures.size(); ++i) {
+        states.push_back(futures[i].state());
+    }
+
+    return future< void >(internal::when_all(&states[0], states.size()));
+}
+
+template< typename T0, typename T1 >
+inline future< void > when_all(future< T0 > const& f0, future< T1 > const& f1) {
+    internal::future_state_base* states[] = { f0.state(), f1.state() };
+    return future< void >(internal::when_all(states, 2));
+}
+
+template< typename T0, typename T1, typename T2 >
+inline future< void > when_all(future< T0 > const& f0, future< T1 > const& f1, future< T2 > const& f2) {
+    internal::future_state_base* states[] = { f0.state(), f1.state(), f2.state() };
+    return future< void >(internal::when_all(states, 3));
+}
+
+// Ready with the index of the first future in futures to become ready
+template< typename T >
+inline future< size_t > when_any(std::vector< future< T > > const& futures) {
+    assert(!futures.empty());
+    task_manager* manager = futures[0].state()->manager();
+    internal::future_state< size_t >* target = internal::future_state< size_t >::create(manager);
+    void* block = internal::closure_pool::instance().allocate(sizeof(internal::when_any_selector));
+    internal::when_any_selector* selector = new (block) internal::when_any_selector;
+    selector->claimed.store(0, memory_order_relaxed);
+    selector->remaining.store(static_cast< int32_t >(futures.size()), memory_order_relaxed);
+    selector->target = target;
+    for (size_t i = 0; i < futures.size(); ++i) {
+        internal::when_any_arrive arrive = { selector, i };
+        futures[i].state()->set_callback(task_closure(arrive));
+    }
+
+    return future< size_t >(target);
+}
+
+//============================================================================
+// Implementation
+//============================================================================
+inline void internal::future_state_base::set_continuation(task_closure const& continuation, task_priority priority) {
+    continuation_priority_ = priority;
+    inline_continuation_ = false;
+    attach(continuation);
+}
+
+inline void internal::future_state_base::set_callback(task_closure const& callback) {
+    inline_continuation_ = true;
+    attach(callback);
+}
+
+inline void internal::future_state_base::attach(task_closure const& continuation) {
+    continuation_ = continuation;
+    uint32_t flags = flags_.load(memory_order_acquire);
+    while (true) {
+        assert((flags & kHasContinuation) == 0);
+        if (flags & kReady) {
+            run_continuation();
+            return;
+        }
+
+        if (flags_.compare_exchange_weak(flags, flags | kHasContinuation, memory_order_acq_rel)) {
+            return;
+        }
+    }
+}
+
+inline void internal::future_state_base::wait() {
+    uint32_t flags = flags_.load(memory_order_acquire);
+    while ((flags & kReady) == 0) {
+        if (flags_.compare_exchange_weak(flags, flags | kWaiting, memory_order_acq_rel)) {
+            is_ready done = { this };
+            manager_->help_until(done);
+            return;
+        }
+    }
+}
+
+inline internal::future_state< void >* internal::when_all(future_state_base* const* states, size_t count) {
+    assert(count != 0);
+    future_state< void >* target = future_state< void >::create(states[0]->manager());
+    void* block = closure_pool::instance().allocate(sizeof(when_all_counter));
+    when_all_counter* counter = new (block) when_all_counter;
+    counter->remaining.store(static_cast< int32_t >(count), memory_order_relaxed);
+    counter->target = target;
+    for (size_t i = 0; i < count; ++i) {
+        when_all_arrive arrive = { counter };
+        states[i]->set_callback(task_closure(arrive));
+    }
+
+    return target;
+}
+
+inline void internal::future_state_base::publish() {
+    uint32_t flags = flags_.exchange(kReady, memory_order_acq_rel);
+    if (flags & kWaiting) {
+        manager_->wake_helpers();
+    }
+
+    if (flags & kHasContinuation) {
+        run_continuation();
+    }
+}
+
+inline void internal::future_state_base::run_continuation() {
+    if (inline_continuation_) {
+        continuation_.run();
+    }
+    else {
+        manager_->add(continuation_, continuation_priority_);
+    }
+}
+
+template< typename T >
+template< typename F >
+inline future< typename internal::continuation_result< F, T >::type > future< T >::then(F const& f, task_priority priority) const {
+    typedef typename internal::continuation_result< F, T >::type result_type;
+    internal::future_state< result_type >* target = internal::future_state< result_type >::create(state_->manager());
+    state_->add_reference();
+    internal::then_task< F, T, result_type > work = { f, state_, target };
+    state_->set_continuation(task_closure(work), priority);
+    return future< result_type >(target);
+}
+
+#endif // FUTURE_HPP
@@ -0,0 +1,106 @@
+/*
+ *  index_free_list.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Lock-free free list of the indices [0, size), as a Treiber stack threaded
+// through a preallocated next array. The head packs the top index with a
+// tag that is bumped on every change, so a pop can't be fooled by the same
+// index being popped and pushed back in between (ABA). Neither push nor pop
+// allocate.
+
+#ifndef INDEX_FREE_LIST_HPP
+#define INDEX_FREE_LIST_HPP
+
+#include "atomic.hpp"
+#include <stdint.h>
+
+class index_free_list
+{
+public:
+
+    enum { kEmpty = -1 };
+
+public:
+
+    explicit index_free_list(size_t size);
+
+    ~index_free_list();
+
+    // Returns kEmpty if every index is taken
+    int32_t pop();
+
+    void push(int32_t index);
+
+private:
+
+    index_free_list(index_free_list const&);
+    index_free_list& operator=(index_free_list const&);
+
+    static uint64_t pack(uint32_t tag, int32_t index) {
+        return (static_cast< uint64_t >(tag) << 32) | static_cast< uint32_t >(index);
+    }
+
+    static uint32_t tag_of(uint64_t head) {
+        return static_cast< uint32_t >(head >> 32);
+    }
+
+    static int32_t index_of(uint64_t head) {
+        return static_cast< int32_t >(static_cast< uint32_t >(head));
+    }
+
+private:
+
+    enum { kCachelineSize = 64 };
+    typedef char cacheline_pad [kCachelineSize];
+
+    cacheline_pad pad0_;
+    atomic< uint64_t > head_;
+    cacheline_pad pad1_;
+    int32_t volatile* const next_;
+};
+
+
+inline index_free_list::index_free_list(size_t size)
+: next_(new int32_t[size]) {
+    for (size_t i = 0; i < size; ++i) {
+        next_[i] = (i + 1 < size) ? static_cast< int32_t >(i + 1) : kEmpty;
+    }
+
+    head_.store(pack(0, size > 0 ? 0 : kEmpty), memory_order_relaxed);
+}
+
+inline index_free_list::~index_free_list() {
+    delete [] next_;
+}
+
+inline int32_t index_free_list::pop() {
+    uint64_t head = head_.load(memory_order_acquire);
+    while (true) {
+        int32_t index = index_of(head);
+        if (index == kEmpty) {
+            return kEmpty;
+        }
+
+        // next_[index] may be stale if another thread pops index first, in
+        // which case the tag has moved on and the CAS fails.
+        uint64_t next = pack(tag_of(head) + 1, next_[index]);
+        if (head_.compare_exchange_weak(head, next, memory_order_acquire)) {
+            return index;
+        }
+    }
+}
+
+inline void index_free_list::push(int32_t index) {
+    uint64_t head = head_.load(memory_order_relaxed);
+    while (true) {
+        next_[index] = index_of(head);
+        uint64_t next = pack(tag_of(head) + 1, index);
+        if (head_.compare_exchange_weak(head, next, memory_order_release)) {
+            return;
+        }
+    }
+}
+
+#endif // INDEX_FREE_LIST_HPP
@@ -0,0 +1,99 @@
+/*
+ *  lock_stats.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Contention counters and hold times for mutex and spin_lock. Recording
+// costs a clock read per acquisition and per release, so it's compiled out
+// unless TASK_SCHEDULER_LOCK_STATS is defined to 1; stats() then returns
+// all zeroes. The counters are only written while the lock is held, so
+// they need no atomics of their own, and a snapshot taken without holding
+// the lock is a hint.
+
+#ifndef LOCK_STATS_HPP
+#define LOCK_STATS_HPP
+
+#include "scheduler_common.hpp"
+#include <stdint.h>
+
+#ifndef TASK_SCHEDULER_LOCK_STATS
+#define TASK_SCHEDULER_LOCK_STATS 0
+#endif
+
+struct lock_stats
+{
+    lock_stats()
+    : acquisitions(0),
+      contended(0),
+      parked(0),
+      wait_ns(0),
+      hold_ns(0),
+      max_hold_ns(0) {
+    }
+
+    uint64_t acquisitions;
+    uint64_t contended;     // acquisitions that didn't get the lock at once
+    uint64_t parked;        // of which went to sleep (mutex only)
+    uint64_t wait_ns;       // total time spent getting contended locks
+    uint64_t hold_ns;       // total time the lock was held
+    uint64_t max_hold_ns;
+};
+
+namespace internal
+{
+    class lock_stats_recorder
+    {
+    public:
+
+#if TASK_SCHEDULER_LOCK_STATS
+        lock_stats_recorder()
+        : acquired_at_(0) {
+        }
+
+        // Before waiting for a contended lock
+        uint64_t begin_wait() const {
+            return now_ns();
+        }
+
+        // Holding the lock. wait_start is 0 if it wasn't contended.
+        void acquired(uint64_t wait_start, bool parked) {
+            acquired_at_ = now_ns();
+            ++stats_.acquisitions;
+            if (wait_start != 0) {
+                ++stats_.contended;
+                stats_.wait_ns += acquired_at_ - wait_start;
+            }
+
+            if (parked) {
+                ++stats_.parked;
+            }
+        }
+
+        // Still holding the lock
+        void releasing() {
+            uint64_t held = now_ns() - acquired_at_;
+            stats_.hold_ns += held;
+            if (held > stats_.max_hold_ns) {
+                stats_.max_hold_ns = held;
+            }
+        }
+
+        lock_stats snapshot() const {
+            return stats_;
+        }
+
+    private:
+
+        lock_stats stats_;
+        uint64_t acquired_at_;
+#else
+        uint64_t begin_wait() const { return 0; }
+        void acquired(uint64_t, bool) {}
+        void releasing() {}
+        lock_stats snapshot() const { return lock_stats(); }
+#endif
+    };
+}
+
+#endif // LOCK_STATS_HPP
@@ -1,9 +1,22 @@
 #include "task_distributing_scheduler.hpp"
-//#include "work_stealing_lock_scheduler.hpp"
+#include "work_stealing_lock_scheduler.hpp"
 #include "task_manager.hpp"
+#include "task_graph.hpp"
+#include "parallel_for.hpp"
+#include "future.hpp"
+#include "mpsc_queue.hpp"
+#include "mutex.hpp"
+#include "spin_lock.hpp"
+#include <fstream>
 #include <iostream>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 
 
 double elapsed_time_ms(timeval t1, timeval t2) {
@@ -12,6 +25,17 @@ double elapsed_time_ms(timeval t1, timeval t2) {
 	return elapsedTime;
 }
 
+void print_stats(scheduler_stats const& stats) {
+    std::cout << "  tasks " << stats.tasks_executed
+              << ", steals " << stats.steal_successes << "/" << stats.steal_attempts
+              << ", failed polls " << stats.failed_polls
+              << ", parks " << stats.parks
+              << ", running " << stats.running_ns / 1000000 << " ms"
+              << ", idle " << stats.idle_ns / 1000000 << " ms"
+              << " (parked " << stats.parked_ns / 1000000 << " ms)"
+              << ", max queue depth " << stats.max_queue_depth << std::endl;
+}
+
 uint32_t next_power_of_two(uint32_t v) {
 	v--;
 	v |= v >> 1;
@@ -89,7 +113,6 @@ void dependency_test2_func(void* data) {
 }
 
 void dependency_test2() {
-#if 0
     std::cout << "Starting dependency test 2" << std::endl;
     
     enum { kTestRuns = 5 };
@@ -100,37 +123,42 @@ void dependency_test2() {
         // Create the parent
         dependency_test2_global_context global_ctx;
         dependency_test2_local_context parent_ctx = { &global_ctx, 0 };
-        task_id parentid = jq.create_task(dependency_test2_func, &parent_ctx);
+        task_id parentid = jq.begin_add(dependency_test2_func, &parent_ctx);
         
         // Create first child
         dependency_test2_local_context child1_ctx = { &global_ctx, 1 };
-        task_id child1id = jq.create_task(dependency_test2_func, &child1_ctx);
+        task_id child1id = jq.begin_add(dependency_test2_func, &child1_ctx);
         jq.add_child(parentid, child1id);
         
         // Create the second child
         dependency_test2_local_context child2_ctx = { &global_ctx, 2 };
-        task_id child2id = jq.create_task(dependency_test2_func, &child2_ctx);
+        task_id child2id = jq.begin_add(dependency_test2_func, &child2_ctx);
         jq.add_child(parentid, child2id);
         
         // Create children's dependent task
         dependency_test2_local_context child_dependent_ctx = { &global_ctx, 3 };
-        task_id child_dependentid = jq.create_task(dependency_test2_func, &child_dependent_ctx);
+        task_id child_dependentid = jq.begin_add(dependency_test2_func, &child_dependent_ctx);
         jq.add_dependency(child2id, child_dependentid);
         jq.add_dependency(child1id, child_dependentid);
         jq.add_child(parentid, child_dependentid);
         
         // Add parent's dependent task
         dependency_test2_local_context parent_dependent_ctx = { &global_ctx, 4 };
-        task_id parent_dependentid = jq.create_task(dependency_test2_func, &parent_dependent_ctx);
+        task_id parent_dependentid = jq.begin_add(dependency_test2_func, &parent_dependent_ctx);
         jq.add_dependency(parentid, parent_dependentid);
         
-        jq.submit_current_transaction();
+        jq.end_add(child1id);
+        jq.end_add(child2id);
+        jq.end_add(child_dependentid);
+        jq.end_add(parent_dependentid);
+        jq.end_add(parentid);
         jq.wait(parent_dependentid);
         
         int i = 1;
         mpsc_queue< int >::node* n = 0;
         while ((n = global_ctx.executionOrder.pop()) != 0) {
             std::cout << i << ".) " << n->value << std::endl;
+            delete n;
             ++i;
         }
         
@@ -138,7 +166,6 @@ void dependency_test2() {
     }
     
     std::cout << "Ending dependency test 2\n\n";
-#endif
 }
 
 //============================================================================
@@ -204,6 +231,7 @@ void dependency_test3() {
         mpsc_queue< int >::node* n = 0;
         while ((n = global_ctx.executionOrder.pop()) != 0) {
             std::cout << i << ".) " << n->value << std::endl;
+            delete n;
             ++i;
         }
         
@@ -215,6 +243,240 @@ void dependency_test3() {
 
 
 
+//============================================================================
+// Allocation test
+//============================================================================
+// Every operator new in the program goes through here, and is counted while
+// g_count_allocations is set
+int32_t volatile g_count_allocations = 0;
+int32_t volatile g_allocations = 0;
+
+#if __cplusplus >= 201103L
+#define ALLOCATION_TEST_THROWS
+#define ALLOCATION_TEST_NOTHROW noexcept
+#else
+#define ALLOCATION_TEST_THROWS throw(std::bad_alloc)
+#define ALLOCATION_TEST_NOTHROW throw()
+#endif
+
+void* operator new(size_t size) ALLOCATION_TEST_THROWS {
+    if (g_count_allocations) {
+        atomic_increment(g_allocations);
+    }
+    
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == 0) {
+        throw std::bad_alloc();
+    }
+    
+    return p;
+}
+
+// GCC doesn't see that this delete is the replacement for the new above
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) ALLOCATION_TEST_NOTHROW {
+    free(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* p, size_t) ALLOCATION_TEST_NOTHROW {
+    free(p);
+}
+#endif
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+void allocation_test_task(void* context) {
+    atomic_increment(*static_cast< int32_t volatile* >(context));
+}
+
+// Adds a parent with children and waits for it
+void allocation_test_round(task_manager& manager, int32_t volatile* counter, int children) {
+    task_id parent = manager.begin_add(0, 0);
+    for (int i = 0; i < children; ++i) {
+        task_id child = manager.begin_add(allocation_test_task, (void*)counter);
+        manager.add_child(parent, child);
+        manager.end_add(child);
+    }
+    
+    manager.end_add(parent);
+    manager.wait(parent);
+}
+
+// begin_add, add_child, end_add, wait and finishing a task mustn't allocate
+// once the manager is warmed up
+void allocation_test() {
+    std::cout << "Starting allocation test." << std::endl;
+    
+    enum { kChildren = 64, kRounds = 1000 };
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    task_manager manager(1024, workers);
+    int32_t volatile counter = 0;
+    for (int i = 0; i < 10; ++i) {
+        allocation_test_round(manager, &counter, kChildren);
+    }
+    
+    g_count_allocations = 1;
+    for (int i = 0; i < kRounds; ++i) {
+        allocation_test_round(manager, &counter, kChildren);
+    }
+    
+    g_count_allocations = 0;
+    if (g_allocations == 0 && counter == (kRounds + 10) * kChildren) {
+        std::cout << "Allocation test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Allocation test failed: " << g_allocations << " allocations" << std::endl;
+    }
+    
+    std::cout << "Ending allocation test.\n\n";
+}
+
+//============================================================================
+// MPSC queue test
+//============================================================================
+enum { kMpscProducers = 4, kMpscPushes = 100000 };
+
+struct mpsc_item : mpsc_node
+{
+    int producer;
+    int sequence;
+};
+
+struct mpsc_producer
+{
+    intrusive_mpsc_queue< mpsc_item >* intrusive;
+    pooled_mpsc_queue< int >* pooled;
+    mpsc_item* items;
+    int index;
+};
+
+void mpsc_producer_func(void* data) {
+    mpsc_producer* producer = static_cast< mpsc_producer* >(data);
+    for (int i = 0; i < kMpscPushes; ++i) {
+        producer->items[i].producer = producer->index;
+        producer->items[i].sequence = i;
+        producer->intrusive->push(&producer->items[i]);
+        producer->pooled->push(producer->index * kMpscPushes + i);
+    }
+}
+
+// Every producer's pushes must come out complete and in order
+void mpsc_queue_test() {
+    std::cout << "Starting MPSC queue test." << std::endl;
+    
+    intrusive_mpsc_queue< mpsc_item > intrusive;
+    pooled_mpsc_queue< int > pooled(256);
+    std::vector< mpsc_item > items(kMpscProducers * kMpscPushes);
+    mpsc_producer producers[kMpscProducers];
+    thread threads[kMpscProducers];
+    for (int i = 0; i < kMpscProducers; ++i) {
+        mpsc_producer producer = { &intrusive, &pooled, &items[i * kMpscPushes], i };
+        producers[i] = producer;
+        threads[i] = thread(mpsc_producer_func);
+        threads[i].start(&producers[i]);
+    }
+    
+    int next_intrusive[kMpscProducers] = { 0 };
+    int next_pooled[kMpscProducers] = { 0 };
+    int intrusive_popped = 0, pooled_popped = 0;
+    bool ordered = true;
+    while (intrusive_popped + pooled_popped < 2 * kMpscProducers * kMpscPushes) {
+        mpsc_item* item = intrusive.pop();
+        if (item != 0) {
+            ordered = ordered && item->sequence == next_intrusive[item->producer]++;
+            ++intrusive_popped;
+        }
+        
+        int value = 0;
+        if (pooled.pop(value)) {
+            int producer = value / kMpscPushes;
+            ordered = ordered && value % kMpscPushes == next_pooled[producer]++;
+            ++pooled_popped;
+        }
+    }
+    
+    for (int i = 0; i < kMpscProducers; ++i) {
+        threads[i].join();
+    }
+    
+    if (ordered && intrusive.empty() && pooled.empty()) {
+        std::cout << "MPSC queue test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "MPSC queue test failed" << std::endl;
+    }
+    
+    std::cout << "Ending MPSC queue test.\n\n";
+}
+
+//============================================================================
+// Lock test
+//============================================================================
+enum { kLockThreads = 4, kLockIncrements = 100000 };
+
+template< typename Lock >
+struct lock_test_context
+{
+    Lock lock;
+    int counter;
+};
+
+template< typename Lock >
+void lock_test_func(void* data) {
+    lock_test_context< Lock >* context = static_cast< lock_test_context< Lock >* >(data);
+    for (int i = 0; i < kLockIncrements; ++i) {
+        if (i % 2 == 0 || !context->lock.try_lock()) {
+            context->lock.lock();
+        }
+        
+        ++context->counter;
+        context->lock.unlock();
+    }
+}
+
+template< typename Lock >
+void lock_test(char const* name) {
+    std::cout << "Starting " << name << " lock test." << std::endl;
+    
+    lock_test_context< Lock > context;
+    context.counter = 0;
+    thread threads[kLockThreads];
+    for (int i = 0; i < kLockThreads; ++i) {
+        threads[i] = thread(lock_test_func< Lock >);
+        threads[i].start(&context);
+    }
+    
+    for (int i = 0; i < kLockThreads; ++i) {
+        threads[i].join();
+    }
+    
+    if (context.counter == kLockThreads * kLockIncrements) {
+        std::cout << name << " lock test succeeded" << std::endl;
+    }
+    else {
+        std::cout << name << " lock test failed: " << context.counter << std::endl;
+    }
+    
+#if TASK_SCHEDULER_LOCK_STATS
+    lock_stats stats = context.lock.stats();
+    std::cout << "  acquisitions " << stats.acquisitions << ", contended " << stats.contended
+              << ", parked " << stats.parked << ", waited " << stats.wait_ns / 1000 << " us"
+              << ", held " << stats.hold_ns / 1000 << " us (max " << stats.max_hold_ns << " ns)" << std::endl;
+#endif
+    
+    std::cout << "Ending " << name << " lock test.\n\n";
+}
+
+void lock_tests() {
+    lock_test< mutex >("mutex");
+    lock_test< spin_lock >("spin_lock");
+}
+
 //============================================================================
 // Mandelbrot test
 //============================================================================
@@ -266,12 +528,37 @@ void calculate_mandelbrot_block(void *data)
 	}
 }
 
+// Computes blocks [first, last) of the image, numbered row by row
+struct mandelbrot_body
+{
+	double x, y, width, height;
+	uint8_t* image;
+	
+	void operator()(size_t first, size_t last) const {
+		for (size_t bi = first; bi != last; ++bi) {
+			unsigned bx = bi % kNumHorizontalBlocks;
+			unsigned by = bi / kNumHorizontalBlocks;
+			mandelbrot_block block;
+			block.start_cr = x + double(bx) * width / kNumHorizontalBlocks;
+			block.start_ci = y - double(by) * height / kNumVerticalBlocks;
+			block.result = image + bx * kBlockWidth + by * kBlockHeight * kImageWidth;
+			calculate_mandelbrot_block(&block);
+		}
+	}
+};
+
+// One node per block, the context is the frame's mandelbrot_body
+void mandelbrot_graph_node(void* context, int32_t node) {
+    (*static_cast< mandelbrot_body const* >(context))(node, node + 1);
+}
+
 void mandelbrot_test() {
     std::cout << "Starting mandelbrot test." << std::endl;
     
     // Mandelbrot fractal setup
 	enum { kNumBlocks = kNumHorizontalBlocks * kNumVerticalBlocks };
 	enum { kNumFractals = 4 };
+	double per_block_elapsed = 0.0;
     
     #if 0
 	// Single threaded profiling
@@ -324,7 +611,7 @@ void mandelbrot_test() {
     
 	// Multi-threaded profiling
 	{
-        task_manager jq(next_power_of_two(kNumBlocks));
+        task_manager jq(next_power_of_two(kNumBlocks + 1));
         
 		timeval t1, t2;
 		double mandelbrot_x = -2.0f;
@@ -375,15 +662,1008 @@ void mandelbrot_test() {
 		free(blocks);
 		free(image_mt);
 		std::cout << "Parallel time (ms): " << elapsed << std::endl;
+		per_block_elapsed = elapsed;
+	}
+    
+	// Prebuilt graph profiling: the same blocks, built once and relaunched
+	// with each frame's parameters
+	{
+        task_manager jq(next_power_of_two(kNumBlocks + 1));
+        task_graph graph;
+        for (int bi = 0; bi < kNumBlocks; ++bi) {
+            graph.add_node(mandelbrot_graph_node);
+        }
+        
+        graph.build();
+        
+		timeval t1, t2;
+		mandelbrot_body frames[kNumFractals];
+		uint8_t* image = (uint8_t*)malloc(kImageWidth*kImageHeight);
+		for (unsigned i = 0; i < kNumFractals; ++i) {
+			frames[i].x = i == 0 ? -2.0 : frames[i - 1].x + frames[i - 1].width * 0.05f;
+			frames[i].y = i == 0 ? 1.0 : frames[i - 1].y - frames[i - 1].height * 0.025f;
+			frames[i].width = i == 0 ? 3.0 : frames[i - 1].width * 0.9f;
+			frames[i].height = i == 0 ? 2.0 : frames[i - 1].height * 0.9f;
+			frames[i].image = image;
+		}
+        
+        double elapsed = 0.0f;
+		for(unsigned i = 0; i < kNumFractals; ++i)
+		{
+			printf("Calculating fractal %i/%i with task_graph...\n", i+1, kNumFractals);
+			gettimeofday(&t1, 0);
+			g_delta_cr = frames[i].width/kImageWidth;
+			g_delta_ci = frames[i].height/kImageWidth;
+			jq.launch(graph, &frames[i]);
+			jq.wait(graph);
+			gettimeofday(&t2, 0);
+			double e = elapsed_time_ms(t1, t2);
+			std::cout << e << std::endl;
+			elapsed += e;
+		}
+        
+		free(image);
+		std::cout << "task_graph time (ms): " << elapsed << std::endl;
+		std::cout << "task_graph speedup over per-block tasks: " << (per_block_elapsed / elapsed) << "x" << std::endl;
+	}
+    
+	// parallel_for profiling
+	{
+        task_manager jq(1024);
+        
+		timeval t1, t2;
+		mandelbrot_body body;
+		body.x = -2.0f;
+		body.y = -1.0f;
+		body.width = 3.0f;
+		body.height = 2.0f;
+		body.y += body.height;
+		body.image = (uint8_t*)malloc(kImageWidth*kImageHeight);
+        double elapsed = 0.0f;
+		for(unsigned i = 0; i < kNumFractals; ++i)
+		{
+			printf("Calculating fractal %i/%i with parallel_for...\n", i+1, kNumFractals);
+			gettimeofday(&t1, 0);
+			g_delta_cr = body.width/kImageWidth;
+			g_delta_ci = body.height/kImageWidth;
+			parallel_for(jq, 0, kNumBlocks, body);
+			gettimeofday(&t2, 0);
+			double e = elapsed_time_ms(t1, t2);
+			std::cout << e << std::endl;
+			elapsed += e;
+			
+			body.x += body.width * 0.05f;
+			body.y -= body.height * 0.025f;
+			body.width *= 0.9f;
+			body.height *= 0.9f;
+		}
+        
+		free(body.image);
+		std::cout << "parallel_for time (ms): " << elapsed << std::endl;
+		std::cout << "parallel_for speedup over per-block tasks: " << (per_block_elapsed / elapsed) << "x" << std::endl;
 	}
     
     std::cout << "Ending mandelbrot test.\n\n";
 }
 
+//============================================================================
+// Work stealing deque test
+//============================================================================
+template< typename Scheduler >
+void work_stealing_mandelbrot_test(char const* name) {
+    std::cout << "Starting " << name << " mandelbrot test." << std::endl;
+    
+	enum { kNumBlocks = kNumHorizontalBlocks * kNumVerticalBlocks };
+	enum { kNumFractals = 4 };
+    
+    Scheduler scheduler;
+    
+    timeval t1, t2;
+    double mandelbrot_x = -2.0f;
+    double mandelbrot_y = -1.0f;
+    double mandelbrot_width = 3.0f;
+    double mandelbrot_height = 2.0f;
+    mandelbrot_y += mandelbrot_height;
+    
+    uint8_t* image_mt = (uint8_t*)malloc(kImageWidth*kImageHeight);
+    mandelbrot_block* blocks = (mandelbrot_block*)malloc(kNumBlocks*sizeof(mandelbrot_block));
+    double elapsed = 0.0f;
+    for(unsigned i = 0; i < kNumFractals; ++i)
+    {
+        gettimeofday(&t1, 0);
+        g_delta_cr = mandelbrot_width/kImageWidth;
+        g_delta_ci = mandelbrot_height/kImageWidth;
+        unsigned bi = 0;
+        for(unsigned by = 0; by < kNumVerticalBlocks; ++by)
+            for(unsigned bx = 0; bx < kNumHorizontalBlocks; ++bx)
+            {
+                mandelbrot_block &block = blocks[bi++];
+                block.start_cr = mandelbrot_x + double(bx) * mandelbrot_width / kNumHorizontalBlocks;
+                block.start_ci = mandelbrot_y - double(by) * mandelbrot_height / kNumVerticalBlocks;
+                block.result = image_mt + bx * kBlockWidth + by * kBlockHeight * kImageWidth;
+                scheduler.submit_task(calculate_mandelbrot_block, &block);
+            }
+        
+        scheduler.wait_for_all_tasks();
+        gettimeofday(&t2, 0);
+        double e = elapsed_time_ms(t1, t2);
+        std::cout << e << std::endl;
+        elapsed += e;
+        
+        mandelbrot_x += mandelbrot_width * 0.05f;
+        mandelbrot_y -= mandelbrot_height * 0.025f;
+        mandelbrot_width *= 0.9f;
+        mandelbrot_height *= 0.9f;
+    }
+    
+    free(blocks);
+    free(image_mt);
+    std::cout << name << " parallel time (ms): " << elapsed << std::endl;
+    print_stats(scheduler.snapshot());
+    std::cout << "Ending " << name << " mandelbrot test.\n\n";
+}
+
+//============================================================================
+// Parking latency test
+//============================================================================
+struct latency_sample
+{
+    timeval started;
+    int volatile done;
+};
+
+void latency_task(void* data) {
+    latency_sample* sample = static_cast< latency_sample* >(data);
+    gettimeofday(&sample->started, 0);
+    compiler_barrier();
+    sample->done = 1;
+}
+
+inline void submit(task_manager& scheduler, task_function func, void* context) {
+    scheduler.add(func, context);
+}
+
+template< typename Scheduler >
+inline void submit(Scheduler& scheduler, task_function func, void* context) {
+    scheduler.submit_task(func, context);
+}
+
+double cpu_time_ms() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    timeval zero = { 0, 0 };
+    return elapsed_time_ms(zero, usage.ru_utime) + elapsed_time_ms(zero, usage.ru_stime);
+}
+
+// Measures how long a task submitted to an idle (parked) pool takes to start
+// running, and how much CPU the idle pool burns.
+template< typename Scheduler >
+void parking_latency_test(Scheduler& scheduler, char const* name) {
+    std::cout << "Starting " << name << " parking latency test." << std::endl;
+    
+    enum { kSamples = 200 };
+    std::vector< double > latencies;
+    for (int i = 0; i < kSamples; ++i) {
+        // give the workers time to run out of spins and park
+        thread::sleep(0, 2000000);
+        
+        latency_sample sample;
+        sample.done = 0;
+        timeval submitted;
+        gettimeofday(&submitted, 0);
+        submit(scheduler, latency_task, &sample);
+        while (sample.done == 0) {
+            active_pause();
+        }
+        
+        latencies.push_back(elapsed_time_ms(submitted, sample.started) * 1000.0);
+    }
+    
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "submit-to-start (us) p50: " << latencies[kSamples / 2]
+              << " p99: " << latencies[(kSamples * 99) / 100]
+              << " max: " << latencies.back() << std::endl;
+    
+    enum { kIdleMs = 500 };
+    double cpu_before = cpu_time_ms();
+    thread::sleep(0, kIdleMs * 1000000);
+    double cpu_idle = cpu_time_ms() - cpu_before;
+    std::cout << "idle CPU usage: " << (100.0 * cpu_idle / kIdleMs) << "% of one core" << std::endl;
+    std::cout << "Ending " << name << " parking latency test.\n\n";
+}
+
+void parking_latency_tests() {
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    {
+        task_manager scheduler(64, workers);
+        parking_latency_test(scheduler, "task_manager");
+    }
+    {
+        task_distributing_scheduler scheduler(64, workers);
+        parking_latency_test(scheduler, "task_distributing_scheduler");
+    }
+    {
+        task_distributing_scheduler scheduler(64, workers, kDistributorThread);
+        parking_latency_test(scheduler, "task_distributing_scheduler (distributor thread)");
+    }
+    {
+        work_stealing_scheduler scheduler(workers);
+        parking_latency_test(scheduler, "work_stealing_scheduler");
+    }
+    
+    // Trades the idle cpu for latency, see scheduler_settings
+    {
+        task_manager scheduler(64, workers, scheduler_settings::low_latency(workers));
+        parking_latency_test(scheduler, "task_manager (spinning workers)");
+    }
+    {
+        work_stealing_scheduler scheduler(workers, scheduler_settings::low_latency(workers));
+        parking_latency_test(scheduler, "work_stealing_scheduler (spinning workers)");
+    }
+}
+
+//============================================================================
+// Closure test
+//============================================================================
+struct add_value
+{
+    atomic< int >* sum;
+    int value;
+    
+    void operator()() const {
+        sum->fetch_add(value, memory_order_relaxed);
+    }
+};
+
+// Too big to be stored inline, goes through the closure pool
+struct add_values
+{
+    atomic< int >* sum;
+    int values[32];
+    
+    void operator()() const {
+        for (int i = 0; i < 32; ++i) {
+            sum->fetch_add(values[i], memory_order_relaxed);
+        }
+    }
+};
+
+template< typename F >
+inline void submit_closure(task_manager& scheduler, F const& f) {
+    scheduler.add(f);
+}
+
+template< typename Scheduler, typename F >
+inline void submit_closure(Scheduler& scheduler, F const& f) {
+    scheduler.submit_task(f);
+}
+
+template< typename Scheduler >
+void closure_test(Scheduler& scheduler, char const* name) {
+    std::cout << "Starting " << name << " closure test." << std::endl;
+    
+    enum { kTasks = 1000 };
+    atomic< int > sum;
+    sum.store(0, memory_order_relaxed);
+    int expected = 0;
+    for (int i = 0; i < kTasks; ++i) {
+        add_value small = { &sum, 1 };
+        submit_closure(scheduler, small);
+        expected += 1;
+        
+        add_values big;
+        big.sum = &sum;
+        std::fill(big.values, big.values + 32, 1);
+        submit_closure(scheduler, big);
+        expected += 32;
+        
+#if __cplusplus >= 201103L
+        atomic< int >* total = &sum;
+        submit_closure(scheduler, [total, i]() { total->fetch_add(i % 2, memory_order_relaxed); });
+        expected += i % 2;
+        
+        // std::string isn't trivially copyable, so this one is pooled too
+        std::string text("closure");
+        submit_closure(scheduler, [total, text]() { total->fetch_add(int(text.size()), memory_order_relaxed); });
+        expected += 7;
+#endif
+    }
+    
+    while (sum.load(memory_order_acquire) != expected) {
+        thread::yield();
+    }
+    
+    std::cout << name << " closure test succeeded" << std::endl;
+    std::cout << "Ending " << name << " closure test.\n\n";
+}
+
+// wait_for_all_tasks returns only once every task submitted has run
+template< typename Scheduler >
+void wait_for_all_test(Scheduler& scheduler, char const* name) {
+    enum { kTasks = 1000 };
+    atomic< int > sum;
+    sum.store(0, memory_order_relaxed);
+    for (int i = 0; i < kTasks; ++i) {
+        add_values big;
+        big.sum = &sum;
+        std::fill(big.values, big.values + 32, 1);
+        scheduler.submit_task(big);
+    }
+    
+    scheduler.wait_for_all_tasks();
+    if (sum.load(memory_order_acquire) == kTasks * 32) {
+        std::cout << name << " wait_for_all_tasks test succeeded" << std::endl;
+    }
+    else {
+        std::cout << name << " wait_for_all_tasks test failed" << std::endl;
+    }
+}
+
+void closure_tests() {
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    {
+        task_manager scheduler(8192, workers);
+        closure_test(scheduler, "task_manager");
+    }
+    {
+        task_distributing_scheduler scheduler(8192, workers);
+        closure_test(scheduler, "task_distributing_scheduler");
+        wait_for_all_test(scheduler, "task_distributing_scheduler");
+    }
+    {
+        task_distributing_scheduler scheduler(8192, workers, kDistributorThread);
+        closure_test(scheduler, "task_distributing_scheduler (distributor thread)");
+        wait_for_all_test(scheduler, "task_distributing_scheduler (distributor thread)");
+    }
+    {
+        // small segments, so the closures run through many of them
+        unbounded_task_distributing_scheduler scheduler(64, workers);
+        closure_test(scheduler, "unbounded_task_distributing_scheduler");
+    }
+    {
+        work_stealing_lock_scheduler scheduler(workers);
+        closure_test(scheduler, "work_stealing_lock_scheduler");
+    }
+    {
+        work_stealing_scheduler scheduler(workers);
+        closure_test(scheduler, "work_stealing_scheduler");
+    }
+}
+
+//============================================================================
+// Future test
+//============================================================================
+struct square
+{
+    typedef int result_type;
+    int value;
+    
+    int operator()() const {
+        return value * value;
+    }
+};
+
+struct add_one
+{
+    typedef int result_type;
+    
+    int operator()(int value) const {
+        return value + 1;
+    }
+};
+
+void future_test() {
+    std::cout << "Starting future test." << std::endl;
+    
+    enum { kFutures = 1000 };
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    task_manager manager(4096, workers);
+    std::vector< future< int > > futures;
+    int expected = 0;
+    for (int i = 0; i < kFutures; ++i) {
+        square work = { i };
+        futures.push_back(spawn(manager, work).then(add_one()));
+        expected += i * i + 1;
+    }
+    
+    future< void > all = when_all(futures);
+    all.wait();
+    int sum = 0;
+    for (int i = 0; i < kFutures; ++i) {
+        sum += futures[i].get();
+    }
+    
+    std::vector< future< int > > racers;
+    for (int i = 0; i < 8; ++i) {
+        square work = { i };
+        racers.push_back(spawn(manager, work));
+    }
+    
+    size_t first = when_any(racers).get();
+    bool any_ready = first < racers.size() && racers[first].ready();
+    
+    // The others may still be running, and the manager mustn't go first
+    for (size_t i = 0; i < racers.size(); ++i) {
+        racers[i].wait();
+    }
+    
+    bool chained = true;
+#if __cplusplus >= 201103L
+    future< int > answer = spawn(manager, []() { return 21; }).then([](int value) { return value * 2; });
+    future< void > both = when_all(answer, spawn(manager, []() {}));
+    both.get();
+    chained = answer.ready() && answer.get() == 42;
+#endif
+    
+    if (sum == expected && any_ready && chained) {
+        std::cout << "Future test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Future test failed: sum " << sum << " expected " << expected << std::endl;
+    }
+    
+    std::cout << "Ending future test.\n\n";
+}
+
+//============================================================================
+// Nested wait test
+//============================================================================
+// Every task splits its range in two, adds both halves and waits for them
+// from inside the worker it's running on.
+struct parallel_sum
+{
+    enum { kLeafSize = 128 };
+    
+    task_manager* manager;
+    int const* values;
+    int begin;
+    int end;
+    int64_t* result;
+    
+    void operator()() const {
+        if (end - begin <= kLeafSize) {
+            int64_t sum = 0;
+            for (int i = begin; i < end; ++i) {
+                sum += values[i];
+            }
+            
+            *result = sum;
+            return;
+        }
+        
+        int middle = begin + (end - begin) / 2;
+        int64_t left_sum = 0, right_sum = 0;
+        parallel_sum left = { manager, values, begin, middle, &left_sum };
+        parallel_sum right = { manager, values, middle, end, &right_sum };
+        task_id left_id = manager->begin_add(left);
+        task_id right_id = manager->begin_add(right);
+        manager->end_add(left_id);
+        manager->end_add(right_id);
+        manager->wait(left_id);
+        manager->wait(right_id);
+        *result = left_sum + right_sum;
+    }
+};
+
+void nested_wait_test() {
+    std::cout << "Starting nested wait test." << std::endl;
+    
+    enum { kValues = 1 << 16, kRuns = 20 };
+    std::vector< int > values(kValues);
+    int64_t expected = 0;
+    for (int i = 0; i < kValues; ++i) {
+        values[i] = i % 1000;
+        expected += values[i];
+    }
+    
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    task_manager manager(4096, workers);
+    bool success = true;
+    for (int run = 0; run < kRuns; ++run) {
+        int64_t sum = 0;
+        parallel_sum root = { &manager, &values[0], 0, kValues, &sum };
+        task_id id = manager.begin_add(root);
+        manager.end_add(id);
+        manager.wait(id);
+        success = success && sum == expected;
+    }
+    
+    if (success) {
+        std::cout << "Nested wait test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Nested wait test failed" << std::endl;
+    }
+    
+    print_stats(manager.snapshot());
+    std::cout << "Ending nested wait test.\n\n";
+}
+
+//============================================================================
+// Task graph test
+//============================================================================
+// A grid where every node depends on its left and upper neighbours, so each
+// node can check that both have already run in this frame.
+enum { kGraphGridSize = 32 };
+
+struct graph_test_frame
+{
+    int frame;
+    int volatile stamps[kGraphGridSize * kGraphGridSize];
+    int volatile errors;
+};
+
+void graph_test_node(void* context, int32_t node) {
+    graph_test_frame* frame = static_cast< graph_test_frame* >(context);
+    int x = node % kGraphGridSize;
+    int y = node / kGraphGridSize;
+    if ((x > 0 && frame->stamps[node - 1] != frame->frame) ||
+        (y > 0 && frame->stamps[node - kGraphGridSize] != frame->frame)) {
+        atomic_increment(frame->errors);
+    }
+    
+    frame->stamps[node] = frame->frame;
+}
+
+// Runs the whole graph from inside a task, to check launch and wait nest
+struct graph_test_inner
+{
+    task_manager* manager;
+    task_graph* graph;
+    graph_test_frame* frame;
+    
+    void operator()() const {
+        manager->launch(*graph, frame);
+        manager->wait(*graph);
+    }
+};
+
+void graph_count_node(void* context, int32_t node) {
+    atomic_increment(*static_cast< int32_t volatile* >(context));
+}
+
+// More roots than the manager has room for in its shared queue, each with a
+// successor, launched from outside the pool
+bool wide_graph_test(size_t workers) {
+    enum { kRoots = 4096, kMaxTasks = 64 };
+    task_graph graph;
+    for (int i = 0; i < kRoots; ++i) {
+        task_graph::node_id root = graph.add_node(graph_count_node);
+        graph.add_dependency(root, graph.add_node(graph_count_node));
+    }
+    
+    task_manager manager(kMaxTasks, workers);
+    bool success = true;
+    for (int i = 0; i < 3; ++i) {
+        int32_t volatile count = 0;
+        manager.launch(graph, (void*)&count);
+        manager.wait(graph);
+        success = success && count == 2 * kRoots;
+    }
+    
+    return success;
+}
+
+void task_graph_test() {
+    std::cout << "Starting task graph test." << std::endl;
+    
+    enum { kFrames = 100 };
+    task_graph graph;
+    for (int y = 0; y < kGraphGridSize; ++y) {
+        for (int x = 0; x < kGraphGridSize; ++x) {
+            task_graph::node_id node = graph.add_node(graph_test_node, y == 0 ? kPriorityHigh : kPriorityNormal);
+            if (x > 0) {
+                graph.add_dependency(node - 1, node);
+            }
+            
+            if (y > 0) {
+                graph.add_dependency(node - kGraphGridSize, node);
+            }
+        }
+    }
+    
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    task_manager manager(1024, workers);
+    graph_test_frame frames[2];
+    std::memset(frames, 0, sizeof(frames));
+    bool success = true;
+    for (int i = 1; i <= kFrames; ++i) {
+        graph_test_frame& frame = frames[i % 2];
+        frame.frame = i;
+        if (i % 10 == 0) {
+            graph_test_inner inner = { &manager, &graph, &frame };
+            task_id id = manager.begin_add(inner);
+            manager.end_add(id);
+            manager.wait(id);
+        }
+        else {
+            manager.launch(graph, &frame);
+            manager.wait(graph);
+        }
+        
+        for (int n = 0; n < kGraphGridSize * kGraphGridSize; ++n) {
+            success = success && frame.stamps[n] == i;
+        }
+    }
+    
+    success = success && frames[0].errors == 0 && frames[1].errors == 0;
+    success = wide_graph_test(0) && wide_graph_test(2) && success;
+    if (success) {
+        std::cout << "Task graph test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Task graph test failed" << std::endl;
+    }
+    
+    print_stats(manager.snapshot());
+    std::cout << "Ending task graph test.\n\n";
+}
+
+//============================================================================
+// Trace test
+//============================================================================
+void trace_test() {
+#if TASK_SCHEDULER_TRACE
+    std::cout << "Starting trace test." << std::endl;
+    
+    enum { kValues = 1 << 14 };
+    std::vector< int > values(kValues, 1);
+    int workers = std::max(internal::number_of_cores() - 1, 1);
+    task_manager manager(1024, workers);
+    int64_t sum = 0;
+    parallel_sum root = { &manager, &values[0], 0, kValues, &sum };
+    task_id id = manager.begin_add(root);
+    manager.end_add(id);
+    manager.wait(id);
+    
+    char const* path = "task_scheduler_trace.json";
+    std::ofstream out(path);
+    manager.write_trace(out);
+    out.close();
+    
+    std::ifstream in(path);
+    std::string trace((std::istreambuf_iterator< char >(in)), std::istreambuf_iterator< char >());
+    if (sum == kValues && trace.find("\"ph\":\"B\"") != std::string::npos) {
+        std::cout << "Trace test succeeded, wrote " << path << std::endl;
+    }
+    else {
+        std::cout << "Trace test failed" << std::endl;
+    }
+    
+    std::cout << "Ending trace test.\n\n";
+#endif
+}
+
+//============================================================================
+// Affinity test
+//============================================================================
+struct affinity_record
+{
+    int worker;             // the worker it was sent to
+    void* ran_on;           // the thread that ran it
+};
+
+void affinity_task(void* context) {
+    affinity_record* record = static_cast< affinity_record* >(context);
+    record->ran_on = &internal::current_thread_context();
+    
+    // long enough for idle workers to come looking
+    volatile int spin = 0;
+    for (int i = 0; i < 20000; ++i) {
+        spin = spin + 1;
+    }
+}
+
+// Whether every task sent to a worker ran on one thread, a different one for
+// each worker, filling in which thread each worker is
+bool ran_pinned(std::vector< affinity_record > const& records, std::vector< void* >& workers) {
+    for (size_t i = 0; i < records.size(); ++i) {
+        void*& worker = workers[records[i].worker];
+        if (records[i].ran_on == 0 || (worker != 0 && worker != records[i].ran_on)) {
+            return false;
+        }
+        
+        worker = records[i].ran_on;
+    }
+    
+    std::vector< void* > distinct(workers);
+    std::sort(distinct.begin(), distinct.end());
+    return std::unique(distinct.begin(), distinct.end()) == distinct.end();
+}
+
+void affinity_test() {
+    std::cout << "Starting affinity test." << std::endl;
+    
+    enum { kWorkers = 3, kTasks = 600, kHomeTasks = 30 };
+    std::vector< affinity_record > pinned(kTasks), hinted(kTasks);
+    std::vector< void* > workers(kWorkers, (void*)0);
+    bool success = true;
+    {
+        task_manager manager(2048, kWorkers);
+        task_id parent = manager.begin_add(0, 0);
+        for (int i = 0; i < kTasks; ++i) {
+            affinity_record record = { i % kWorkers, 0 };
+            pinned[i] = record;
+            hinted[i] = record;
+            task_id pinnedid = manager.begin_add_to(record.worker, affinity_task, &pinned[i]);
+            task_id hintedid = manager.begin_add(affinity_task, &hinted[i], kPriorityNormal, record.worker);
+            manager.add_child(parent, pinnedid);
+            manager.add_child(parent, hintedid);
+            manager.end_add(pinnedid);
+            manager.end_add(hintedid);
+        }
+        
+        manager.end_add(parent);
+        manager.wait(parent);
+        
+        success = ran_pinned(pinned, workers);
+        size_t home = 0;
+        for (int i = 0; i < kTasks; ++i) {
+            success = success && hinted[i].ran_on != 0;
+            home += hinted[i].ran_on == workers[hinted[i].worker] ? 1 : 0;
+        }
+        
+        std::cout << "task_manager ran " << home << " of " << kTasks << " hinted tasks on their worker" << std::endl;
+    }
+    
+    // Sent one at a time, every hinted task finds its worker idle and runs
+    // there, as nobody else may take one for a second
+    {
+        scheduler_settings settings;
+        settings.idle_spins = 1;
+        settings.affinity_delay_ns = 1000000000;
+        task_manager manager(2048, kWorkers, settings);
+        std::vector< affinity_record > owners(kHomeTasks), guests(kHomeTasks);
+        std::vector< void* > threads(kWorkers, (void*)0);
+        for (int i = 0; i < kHomeTasks; ++i) {
+            affinity_record record = { i % kWorkers, 0 };
+            owners[i] = record;
+            guests[i] = record;
+            task_id pinnedid = manager.begin_add_to(record.worker, affinity_task, &owners[i]);
+            manager.end_add(pinnedid);
+            manager.wait(pinnedid);
+            task_id hintedid = manager.begin_add(affinity_task, &guests[i], kPriorityNormal, record.worker);
+            manager.end_add(hintedid);
+            manager.wait(hintedid);
+        }
+        
+        success = ran_pinned(owners, threads) && ran_pinned(guests, threads) && success;
+    }
+    
+    {
+        work_stealing_scheduler scheduler(kWorkers);
+        std::fill(workers.begin(), workers.end(), (void*)0);
+        for (int i = 0; i < kTasks; ++i) {
+            pinned[i].ran_on = 0;
+            scheduler.submit_to(pinned[i].worker, affinity_task, &pinned[i]);
+        }
+        
+        scheduler.wait_for_all_tasks();
+        success = ran_pinned(pinned, workers) && success;
+    }
+    
+    if (success) {
+        std::cout << "Affinity test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Affinity test failed" << std::endl;
+    }
+    
+    std::cout << "Ending affinity test.\n\n";
+}
+
+//============================================================================
+// Cancellation test
+//============================================================================
+struct cancellation_context
+{
+    task_manager* manager;
+    int32_t volatile started;       // set by the task that polls
+    int32_t volatile ran;
+    int32_t volatile dependent_ran;
+};
+
+// Runs until its frame is cancelled
+void cancellable_poller(void* data) {
+    cancellation_context* context = static_cast< cancellation_context* >(data);
+    context->started = 1;
+    while (!context->manager->cancelled()) {
+        thread::yield();
+    }
+}
+
+void cancellable_child(void* data) {
+    cancellation_context* context = static_cast< cancellation_context* >(data);
+    atomic_increment(context->ran);
+    volatile int spin = 0;
+    for (int i = 0; i < 20000; ++i) {
+        spin = spin + 1;
+    }
+}
+
+void cancellation_dependent(void* data) {
+    static_cast< cancellation_context* >(data)->dependent_ran = 1;
+}
+
+// Begins empty tasks until one gets the given id, which ids being reused
+// last in first out makes about the first once that id is free. A task's id
+// is freed just after wait() sees it finish, so hold on to the others, lest
+// they come back first, and give whoever frees it the cpu meanwhile.
+task_id begin_add_reusing(task_manager& manager, task_id id) {
+    std::vector< task_id > others;
+    task_id next = manager.begin_add(0, 0);
+    while (next != id) {
+        others.push_back(next);
+        thread::yield();
+        next = manager.begin_add(0, 0);
+    }
+    
+    for (size_t i = 0; i < others.size(); ++i) {
+        manager.end_add(others[i]);
+    }
+    
+    return next;
+}
+
+// Runs a child of a task that reuses stale's id, cancelling that task first
+// if cancel is set, and cancelling stale before it starts. Returns whether
+// the child ran.
+bool run_reusing(task_manager& manager, cancellation_token const& stale, bool cancel) {
+    cancellation_context context = { &manager, 0, 0, 0 };
+    task_id holder = begin_add_reusing(manager, stale.id);
+    task_id child = manager.begin_add(cancellable_child, &context);
+    manager.add_child(holder, child);
+    if (cancel) {
+        manager.cancel(manager.token(holder));
+    }
+    
+    manager.cancel(stale);
+    manager.end_add(child);
+    manager.end_add(holder);
+    manager.wait(holder);
+    return context.ran == 1;
+}
+
+void cancellation_test() {
+    std::cout << "Starting cancellation test." << std::endl;
+    
+    enum { kChildren = 4096 };
+    task_manager manager(8192, 2);
+    cancellation_context context = { &manager, 0, 0, 0 };
+    task_id parent = manager.begin_add(0, 0);
+    task_id poller = manager.begin_add(cancellable_poller, &context);
+    manager.add_child(parent, poller);
+    manager.end_add(poller);
+    for (int i = 0; i < kChildren; ++i) {
+        task_id child = manager.begin_add(cancellable_child, &context);
+        manager.add_child(parent, child);
+        manager.end_add(child);
+    }
+    
+    task_id dependent = manager.begin_add(cancellation_dependent, &context);
+    manager.add_dependency(parent, dependent);
+    manager.end_add(dependent);
+    cancellation_token token = manager.token(parent);
+    manager.end_add(parent);
+    
+    // Cancel part way through, once the poller is running
+    while (context.started == 0) {
+        thread::yield();
+    }
+    
+    manager.cancel(token);
+    manager.wait(parent);
+    manager.wait(dependent);
+    
+    // A late cancel must leave whatever reuses the id alone, neither
+    // cancelling it nor undoing its own cancel
+    bool late = run_reusing(manager, token, false) && !run_reusing(manager, token, true);
+    
+    // Likewise a late dependency, even on the dependent's own id
+    cancellation_context again = { &manager, 0, 0, 0 };
+    task_id late_dependent = manager.begin_add(cancellation_dependent, &again);
+    manager.add_dependency(token, late_dependent);
+    manager.end_add(late_dependent);
+    manager.wait(late_dependent);
+    late = late && again.dependent_ran == 1;
+    
+    std::cout << context.ran << " of " << kChildren << " children ran" << std::endl;
+    if (context.ran < kChildren && context.dependent_ran == 1 && late) {
+        std::cout << "Cancellation test succeeded" << std::endl;
+    }
+    else {
+        std::cout << "Cancellation test failed" << std::endl;
+    }
+    
+    std::cout << "Ending cancellation test.\n\n";
+}
+
+//============================================================================
+// Coroutine test
+//============================================================================
+#if TASK_SCHEDULER_HAS_COROUTINES
+template< typename Scheduler >
+task< int > coroutine_fib(Scheduler& scheduler, int n) {
+    co_await scheduler.schedule();
+    if (n < 2) {
+        co_return n;
+    }
+    
+    task< int > a = coroutine_fib(scheduler, n - 1);
+    task< int > b = coroutine_fib(scheduler, n - 2);
+    co_await when_all(a, b);
+    co_return co_await a + co_await b;
+}
+
+template< typename Scheduler >
+task< int > coroutine_stage(Scheduler& scheduler, int value) {
+    co_await scheduler.schedule();
+    co_return value + 1;
+}
+
+template< typename Scheduler >
+task< int > coroutine_pipeline(Scheduler& scheduler, int stages) {
+    int value = 0;
+    for (int i = 0; i < stages; ++i) {
+        value = co_await coroutine_stage(scheduler, value);
+    }
+    
+    std::vector< task< int > > fan;
+    for (int i = 0; i < 100; ++i) {
+        fan.push_back(coroutine_stage(scheduler, i));
+    }
+    
+    co_await when_all(fan);
+    for (size_t i = 0; i < fan.size(); ++i) {
+        value += co_await fan[i];
+    }
+    
+    co_return value;
+}
+
+template< typename Scheduler >
+void coroutine_test(char const* name) {
+    std::cout << "Starting " << name << " coroutine test." << std::endl;
+    
+    Scheduler scheduler;
+    int fib = sync_wait(coroutine_fib(scheduler, 20));
+    int pipeline = sync_wait(coroutine_pipeline(scheduler, 1000));
+    if (fib == 6765 && pipeline == 1000 + 5050) {
+        std::cout << name << " coroutine test succeeded" << std::endl;
+    }
+    else {
+        std::cout << name << " coroutine test failed: fib " << fib << ", pipeline " << pipeline << std::endl;
+    }
+    
+    std::cout << "Ending " << name << " coroutine test.\n\n";
+}
+#endif
+
+void coroutine_tests() {
+#if TASK_SCHEDULER_HAS_COROUTINES
+    coroutine_test< work_stealing_lock_scheduler >("work_stealing_lock_scheduler");
+    coroutine_test< work_stealing_scheduler >("work_stealing_scheduler");
+#endif
+}
+
 int main (int argc, char * const argv[]) {    
     dependency_test1();
-    //dependency_test2();
+    dependency_test2();
     dependency_test3();
+    allocation_test();
+    mpsc_queue_test();
+    lock_tests();
     mandelbrot_test();
+    work_stealing_mandelbrot_test< work_stealing_lock_scheduler >("work_stealing_lock_scheduler");
+    work_stealing_mandelbrot_test< work_stealing_scheduler >("work_stealing_scheduler");
+    parking_latency_tests();
+    closure_tests();
+    future_test();
+    nested_wait_test();
+    task_graph_test();
+    trace_test();
+    affinity_test();
+    cancellation_test();
+    coroutine_tests();
     return 0;
 }
@@ -59,6 +59,49 @@ public:
 		return true;
 	}
 	
+	// Enqueues up to count elements, claiming all of their cells with a
+	// single CAS. Returns how many were enqueued; fewer than count only if
+	// the queue filled up.
+	size_t enqueue_bulk(T const* first, size_t count) {
+		size_t position = enqueuePos_.load(memory_order_relaxed);
+		size_t claimed = 0;
+		while (true) {
+			// A free cell stays free until a producer claims its position,
+			// which can't happen without moving enqueuePos_ past ours.
+			claimed = 0;
+			while (claimed < count) {
+				size_t sequence = buffer_[(position + claimed) & bufferMask_].sequence.load(memory_order_acquire);
+				if (sequence != position + claimed) {
+					break;
+				}
+				
+				++claimed;
+			}
+			
+			if (claimed == 0) {
+				size_t sequence = buffer_[position & bufferMask_].sequence.load(memory_order_acquire);
+				if (static_cast< intptr_t >(sequence) - static_cast< intptr_t >(position) < 0) {
+					return 0;
+				}
+				
+				position = enqueuePos_.load(memory_order_relaxed);
+				continue;
+			}
+			
+			if (enqueuePos_.compare_exchange_weak(position, position + claimed, memory_order_relaxed)) {
+				break;
+			}
+		}
+		
+		for (size_t i = 0; i < claimed; ++i) {
+			cell* cell = &buffer_[(position + i) & bufferMask_];
+			cell->data = first[i];
+			cell->sequence.store(position + i + 1, memory_order_release);
+		}
+		
+		return claimed;
+	}
+	
 	bool dequeue(T& data) {
 		cell* cell = 0;
 		size_t position = dequeuePos_.load(memory_order_relaxed);
@@ -85,6 +128,54 @@ public:
 		return true;
 	}
 	
+	// Dequeues up to max elements with a single CAS. Returns how many were
+	// dequeued, 0 if the queue was empty.
+	size_t dequeue_bulk(T* out, size_t max) {
+		size_t position = dequeuePos_.load(memory_order_relaxed);
+		size_t claimed = 0;
+		while (true) {
+			claimed = 0;
+			while (claimed < max) {
+				size_t sequence = buffer_[(position + claimed) & bufferMask_].sequence.load(memory_order_acquire);
+				if (sequence != position + claimed + 1) {
+					break;
+				}
+				
+				++claimed;
+			}
+			
+			if (claimed == 0) {
+				size_t sequence = buffer_[position & bufferMask_].sequence.load(memory_order_acquire);
+				if (static_cast< intptr_t >(sequence) - static_cast< intptr_t >(position + 1) < 0) {
+					return 0;
+				}
+				
+				position = dequeuePos_.load(memory_order_relaxed);
+				continue;
+			}
+			
+			if (dequeuePos_.compare_exchange_weak(position, position + claimed, memory_order_relaxed)) {
+				break;
+			}
+		}
+		
+		for (size_t i = 0; i < claimed; ++i) {
+			cell* cell = &buffer_[(position + i) & bufferMask_];
+			out[i] = cell->data;
+			cell->sequence.store(position + i + bufferMask_ + 1, memory_order_release);
+		}
+		
+		return claimed;
+	}
+	
+	// Number of claimed but not yet dequeued cells, only a hint while
+	// other threads are using the queue
+	size_t size() const {
+		size_t dequeued = dequeuePos_.load(memory_order_relaxed);
+		size_t enqueued = enqueuePos_.load(memory_order_relaxed);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+	
 private:
 	
 	struct cell
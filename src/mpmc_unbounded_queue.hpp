@@ -0,0 +1,329 @@
+/*
+ *  mpmc_unbounded_queue.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Unbounded variant of mpmc_bounded_queue, with the same interface except
+// that enqueue never fails. Positions are global and the queue is a chain
+// of segments of segmentSize cells, segment i holding positions
+// [i * segmentSize, (i + 1) * segmentSize). Within a segment the cells work
+// like the bounded queue's, minus the wrap around, so the steady state cost
+// of an operation is the same: one CAS on the position plus one store to
+// the cell's sequence.
+//
+// Only the producer that claims the last cell of the tail segment links the
+// next one, and only the consumer that claims the last cell of the head
+// segment moves past it, so head_, tail_ and next are plain stores and
+// can't suffer ABA. Others that run off the end of a segment spin until
+// that's done, just as the bounded queue can't dequeue a claimed cell until
+// its producer publishes it.
+//
+// Segments the head has moved past are recycled as new tail segments once
+// all of their cells have been read, and are only freed with the queue. A
+// thread may still be looking at a recycled segment, but any cell sequence
+// it can match there belongs to the segment's current base, and the CAS on
+// the global position rejects a stale one.
+
+#ifndef MPMC_UNBOUNDED_QUEUE_HPP
+#define MPMC_UNBOUNDED_QUEUE_HPP
+
+#include "atomic.hpp"
+#include <algorithm>
+
+template< typename T >
+class mpmc_unbounded_queue
+{
+public:
+
+	mpmc_unbounded_queue(size_t segmentSize = 1024)
+	: segmentSize_(segmentSize),
+	  oldest_(0) {
+		assert(segmentSize >= 2);
+		segment* first = allocate_segment(0);
+		oldest_ = first;
+		head_.store(first, memory_order_relaxed);
+		tail_.store(first, memory_order_relaxed);
+		enqueuePos_.store(0, memory_order_relaxed);
+		dequeuePos_.store(0, memory_order_relaxed);
+	}
+
+	~mpmc_unbounded_queue() {
+		segment* current = oldest_;
+		while (current != 0) {
+			segment* next = current->next.load(memory_order_relaxed);
+			delete [] current->cells;
+			delete current;
+			current = next;
+		}
+	}
+
+	// Always succeeds, the bool is for symmetry with mpmc_bounded_queue
+	bool enqueue(T const& data) {
+		cell* cell = 0;
+		segment* tail = 0;
+		size_t base = 0;
+		size_t position = 0;
+		while (true) {
+			position = enqueuePos_.load(memory_order_relaxed);
+			tail = tail_.load(memory_order_acquire);
+			base = tail->base.load(memory_order_acquire);
+			if (position - base >= segmentSize_) {
+				// a stale tail, or the next segment is being linked
+				active_pause();
+				continue;
+			}
+
+			cell = &tail->cells[position - base];
+			size_t sequence = cell->sequence.load(memory_order_acquire);
+			if (sequence == position && enqueuePos_.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+				break;
+			}
+		}
+
+		// linked before publishing, whoever dequeues this cell moves on to it
+		if (position - base == segmentSize_ - 1) {
+			link_segment(tail, base + segmentSize_);
+		}
+
+		cell->data = data;
+		cell->sequence.store(position + 1, memory_order_release);
+
+		return true;
+	}
+
+	// Enqueues all count elements, claiming as many cells as the tail
+	// segment has left with each CAS. Returns count.
+	size_t enqueue_bulk(T const* first, size_t count) {
+		size_t enqueued = 0;
+		while (enqueued < count) {
+			size_t position = enqueuePos_.load(memory_order_relaxed);
+			segment* tail = tail_.load(memory_order_acquire);
+			size_t base = tail->base.load(memory_order_acquire);
+			if (position - base >= segmentSize_) {
+				active_pause();
+				continue;
+			}
+
+			size_t available = std::min(count - enqueued, base + segmentSize_ - position);
+			size_t claimed = 0;
+			while (claimed < available) {
+				size_t sequence = tail->cells[position - base + claimed].sequence.load(memory_order_acquire);
+				if (sequence != position + claimed) {
+					break;
+				}
+
+				++claimed;
+			}
+
+			if (claimed == 0 || !enqueuePos_.compare_exchange_weak(position, position + claimed, memory_order_relaxed)) {
+				continue;
+			}
+
+			if (position + claimed == base + segmentSize_) {
+				link_segment(tail, base + segmentSize_);
+			}
+
+			for (size_t i = 0; i < claimed; ++i) {
+				cell* cell = &tail->cells[position - base + i];
+				cell->data = first[enqueued + i];
+				cell->sequence.store(position + i + 1, memory_order_release);
+			}
+
+			enqueued += claimed;
+		}
+
+		return count;
+	}
+
+	bool dequeue(T& data) {
+		cell* cell = 0;
+		segment* head = 0;
+		size_t base = 0;
+		size_t position = 0;
+		while (true) {
+			position = dequeuePos_.load(memory_order_relaxed);
+			head = head_.load(memory_order_acquire);
+			base = head->base.load(memory_order_acquire);
+			if (position - base >= segmentSize_) {
+				if (!moving_head(position, base)) {
+					return false;
+				}
+
+				continue;
+			}
+
+			cell = &head->cells[position - base];
+			size_t sequence = cell->sequence.load(memory_order_acquire);
+			if (sequence == position + 1) {
+				if (dequeuePos_.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (sequence == position) {
+				return false;
+			}
+		}
+
+		if (position - base == segmentSize_ - 1) {
+			head_.store(head->next.load(memory_order_acquire), memory_order_release);
+		}
+
+		data = cell->data;
+		cell->sequence.store(position + segmentSize_, memory_order_release);
+
+		return true;
+	}
+
+	// Dequeues up to max elements from the head segment with a single CAS.
+	// Returns how many were dequeued, 0 if the queue was empty.
+	size_t dequeue_bulk(T* out, size_t max) {
+		segment* head = 0;
+		size_t base = 0;
+		size_t position = 0;
+		size_t claimed = 0;
+		while (true) {
+			position = dequeuePos_.load(memory_order_relaxed);
+			head = head_.load(memory_order_acquire);
+			base = head->base.load(memory_order_acquire);
+			if (position - base >= segmentSize_) {
+				if (!moving_head(position, base)) {
+					return 0;
+				}
+
+				continue;
+			}
+
+			size_t available = std::min(max, base + segmentSize_ - position);
+			claimed = 0;
+			while (claimed < available) {
+				size_t sequence = head->cells[position - base + claimed].sequence.load(memory_order_acquire);
+				if (sequence != position + claimed + 1) {
+					break;
+				}
+
+				++claimed;
+			}
+
+			if (claimed == 0) {
+				if (head->cells[position - base].sequence.load(memory_order_acquire) == position) {
+					return 0;
+				}
+
+				continue;
+			}
+
+			if (dequeuePos_.compare_exchange_weak(position, position + claimed, memory_order_relaxed)) {
+				break;
+			}
+		}
+
+		if (position + claimed == base + segmentSize_) {
+			head_.store(head->next.load(memory_order_acquire), memory_order_release);
+		}
+
+		for (size_t i = 0; i < claimed; ++i) {
+			cell* cell = &head->cells[position - base + i];
+			out[i] = cell->data;
+			cell->sequence.store(position + i + segmentSize_, memory_order_release);
+		}
+
+		return claimed;
+	}
+
+	// Number of claimed but not yet dequeued cells, only a hint while
+	// other threads are using the queue
+	size_t size() const {
+		size_t dequeued = dequeuePos_.load(memory_order_relaxed);
+		size_t enqueued = enqueuePos_.load(memory_order_relaxed);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+
+private:
+
+	// A cell is free while its sequence is its position, full at position
+	// + 1 and read at position + segmentSize.
+	struct cell
+	{
+		atomic< size_t > sequence;
+		T data;
+	};
+
+	struct segment
+	{
+		atomic< size_t > base;
+		atomic< segment* > next;
+		cell* cells;
+	};
+
+	// position is outside the head segment. Returns false if that's because
+	// the queue is empty, otherwise waits a little for head_ to move on.
+	bool moving_head(size_t position, size_t base) {
+		if (position >= base + segmentSize_ && enqueuePos_.load(memory_order_relaxed) <= position) {
+			return false;
+		}
+
+		active_pause();
+		return true;
+	}
+
+	// Only called by the producer of tail's last cell, so never concurrently
+	void link_segment(segment* tail, size_t base) {
+		segment* next = allocate_segment(base);
+		tail->next.store(next, memory_order_release);
+		tail_.store(next, memory_order_release);
+	}
+
+	segment* allocate_segment(size_t base) {
+		segment* recycled = 0;
+		if (oldest_ != 0 && oldest_ != head_.load(memory_order_acquire) && fully_read(oldest_)) {
+			recycled = oldest_;
+			oldest_ = oldest_->next.load(memory_order_relaxed);
+		}
+		else {
+			recycled = new segment;
+			recycled->cells = new cell[segmentSize_];
+		}
+
+		// cells first, then the base, see the class comment
+		recycled->next.store(0, memory_order_relaxed);
+		for (size_t i = 0; i < segmentSize_; ++i) {
+			recycled->cells[i].sequence.store(base + i, memory_order_relaxed);
+		}
+
+		recycled->base.store(base, memory_order_release);
+		return recycled;
+	}
+
+	bool fully_read(segment* segment) const {
+		size_t base = segment->base.load(memory_order_relaxed);
+		for (size_t i = 0; i < segmentSize_; ++i) {
+			if (segment->cells[i].sequence.load(memory_order_acquire) != base + i + segmentSize_) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+private:
+
+	enum { kCachelineSize = 64 };
+	typedef char cacheline_pad [kCachelineSize];
+
+	cacheline_pad pad0_;
+	size_t const segmentSize_;
+	cacheline_pad pad1_;
+	atomic< size_t > enqueuePos_;
+	atomic< segment* > tail_;
+	segment* oldest_;           // only touched by link_segment
+	cacheline_pad pad2_;
+	atomic< size_t > dequeuePos_;
+	atomic< segment* > head_;
+	cacheline_pad pad3_;
+
+	mpmc_unbounded_queue(mpmc_unbounded_queue const&);
+	void operator=(mpmc_unbounded_queue const&);
+};
+
+#endif // MPMC_UNBOUNDED_QUEUE_HPP
@@ -11,7 +11,10 @@
 #define MPSC_QUEUE_HPP
 
 #include "atomic.hpp"
+#include "index_free_list.hpp"
 
+// Allocates a node per push and pop() hands the node that held the value
+// back to the caller to delete, see pooled_mpsc_queue for one that doesn't.
 template< typename T >
 class mpsc_queue
 {
@@ -37,6 +40,16 @@ public:
 		head_ = tail_ = new node;
 	}
 	
+	// Frees the stub and anything still queued
+	~mpsc_queue() {
+		node* current = tail_;
+		while (current != 0) {
+			node* next = current->next;
+			delete current;
+			current = next;
+		}
+	}
+	
 	void push(T& v) {
         node* n = new node(v);
 		n->next = 0;
@@ -56,10 +69,190 @@ public:
 		return 0;
 	}
 	
+private:
+	
+	mpsc_queue(mpsc_queue const&);
+	mpsc_queue& operator=(mpsc_queue const&);
+	
 private:
 	
 	node* volatile head_;
 	node* tail_;
 };
 
+// The link of an intrusive_mpsc_queue, which lives in the queued object
+struct mpsc_node
+{
+	mpsc_node()
+	: mpsc_next_(0) {
+	}
+	
+	mpsc_node* mpsc_next_;
+};
+
+// Vyukov's intrusive MPSC queue. T must derive from mpsc_node, and an object
+// can be in one such queue at a time and must outlive its stay there. push
+// is a single exchange and allocates nothing; the queue keeps a stub node
+// of its own so it never runs completely dry. pop returns null both when
+// the queue is empty and, briefly, when the only pushes left are between
+// their exchange and their link.
+template< typename T >
+class intrusive_mpsc_queue
+{
+public:
+	
+	intrusive_mpsc_queue()
+	: head_(&stub_),
+	  tail_(&stub_) {
+	}
+	
+	// Any thread
+	void push(T* object) {
+		push_node(object);
+	}
+	
+	// Consumer only
+	T* pop() {
+		mpsc_node* tail = tail_;
+		mpsc_node* next = load_acquire(tail->mpsc_next_);
+		if (tail == &stub_) {
+			if (next == 0) {
+				return 0;
+			}
+			
+			tail_ = next;
+			tail = next;
+			next = load_acquire(next->mpsc_next_);
+		}
+		
+		if (next != 0) {
+			tail_ = next;
+			return static_cast< T* >(tail);
+		}
+		
+		if (tail != head_) {
+			return 0;
+		}
+		
+		// tail is the last node, put the stub behind it so it can be taken
+		push_node(&stub_);
+		next = load_acquire(tail->mpsc_next_);
+		if (next != 0) {
+			tail_ = next;
+			return static_cast< T* >(tail);
+		}
+		
+		return 0;
+	}
+	
+	// Exact for the consumer as far as completed pushes go, a hint for
+	// anyone else
+	bool empty() const {
+		return tail_ == &stub_ && head_ == &stub_;
+	}
+	
+private:
+	
+	intrusive_mpsc_queue(intrusive_mpsc_queue const&);
+	intrusive_mpsc_queue& operator=(intrusive_mpsc_queue const&);
+	
+	void push_node(mpsc_node* node) {
+		node->mpsc_next_ = 0;
+		mpsc_node* previous = exchange_pointer(&head_, node);
+		store_release(previous->mpsc_next_, node);
+	}
+	
+private:
+	
+	enum { kCachelineSize = 64 };
+	typedef char cacheline_pad [kCachelineSize];
+	
+	mpsc_node* volatile head_;
+	cacheline_pad pad0_;
+	mpsc_node* tail_;
+	mpsc_node stub_;
+};
+
+// MPSC queue of values on top of intrusive_mpsc_queue. Nodes come from a
+// fixed pool shared by producers and consumer through an index_free_list,
+// falling back to operator new while the pool is exhausted, so steady state
+// pushes and pops don't allocate. T must be default constructible.
+template< typename T >
+class pooled_mpsc_queue
+{
+public:
+	
+	explicit pooled_mpsc_queue(size_t poolSize = 1024)
+	: free_(poolSize),
+	  nodes_(new node[poolSize]),
+	  poolSize_(poolSize) {
+	}
+	
+	~pooled_mpsc_queue() {
+		T value;
+		while (pop(value)) {
+		}
+		
+		delete [] nodes_;
+	}
+	
+	// Any thread
+	void push(T const& value) {
+		node* n = allocate();
+		n->value = value;
+		queue_.push(n);
+	}
+	
+	// Consumer only
+	bool pop(T& value) {
+		node* n = queue_.pop();
+		if (n == 0) {
+			return false;
+		}
+		
+		value = n->value;
+		release(n);
+		return true;
+	}
+	
+	bool empty() const {
+		return queue_.empty();
+	}
+	
+private:
+	
+	struct node : mpsc_node
+	{
+		T value;
+	};
+	
+	pooled_mpsc_queue(pooled_mpsc_queue const&);
+	pooled_mpsc_queue& operator=(pooled_mpsc_queue const&);
+	
+	node* allocate() {
+		int32_t index = free_.pop();
+		if (index != index_free_list::kEmpty) {
+			return &nodes_[index];
+		}
+		
+		return new node;
+	}
+	
+	void release(node* n) {
+		if (n >= nodes_ && n < nodes_ + poolSize_) {
+			free_.push(static_cast< int32_t >(n - nodes_));
+			return;
+		}
+		
+		delete n;
+	}
+	
+private:
+	
+	intrusive_mpsc_queue< node > queue_;
+	index_free_list free_;
+	node* const nodes_;
+	size_t const poolSize_;
+};
+
 #endif // MPSC_QUEUE_HPP
\ No newline at end of file
@@ -11,17 +11,27 @@
 #define MUTEX_HPP
 
 #include "atomic.hpp"
+#include "event_count.hpp"
+#include "lock_stats.hpp"
 #include <algorithm>
 
+// Spins for a while when the lock is taken, adapting how long to how long
+// it took to get the lock the previous times (as glibc's adaptive mutexes
+// do), then parks. The state is the usual three-state futex word, so
+// unlock only looks for parked threads if one may have gone to sleep.
+// Parked threads sleep on an event_count, a futex on Linux.
 class mutex
 {
 private:    
     enum mutex_state_t
     {
         kUnlocked = 0,
-        kLocked = 1
+        kLocked = 1,
+        kContended = 2      // locked, and someone may be parked
     };
     
+    enum { kInitialSpins = 64, kMaxSpins = 4096 };
+    
 public:
     
 	mutex();
@@ -32,41 +42,97 @@ public:
 	
 	void unlock();
 	
+	// See lock_stats.hpp, all zeroes unless TASK_SCHEDULER_LOCK_STATS is 1
+	lock_stats stats() const;
+	
 private:
     
     mutex(mutex const& other);
 	mutex& operator=(mutex const& other);
 	
+	void lock_contended();
+	
 private:
 	
-    atomic< mutex_state_t > state_;
+    atomic< uint32_t > state_;
+    atomic< int32_t > spins_;   // relaxed, it's only a heuristic
+    event_count parked_;
+    internal::lock_stats_recorder stats_;
 };
 
 
 inline mutex::mutex() {
     state_.store(kUnlocked, memory_order_relaxed);
+    spins_.store(kInitialSpins, memory_order_relaxed);
 }
 
 
 inline void mutex::lock() {
-    static mutex_state_t oldstate_ = kUnlocked;
-    unsigned int delay = 1;
-    while()
+    uint32_t expected = kUnlocked;
+    if (state_.compare_exchange_strong(expected, kLocked, memory_order_acquire)) {
+        stats_.acquired(0, false);
+        return;
+    }
+    
+    lock_contended();
 }
 
 inline bool mutex::try_lock() {
-    static mutex_state_t oldstate_ = kUnlocked;
-    mutex_state_t state = state_.load(memory_order_acquire);
-    if (state == kUnlocked) {
-        return state_.compare_exchange_weak(oldstate_, kLocked, memory_order_acquire);
+    uint32_t state = state_.load(memory_order_relaxed);
+    if (state == kUnlocked && state_.compare_exchange_strong(state, kLocked, memory_order_acquire)) {
+        stats_.acquired(0, false);
+        return true;
     }
     
     return false;
 }
 
 inline void mutex::unlock() {
-    state_.store(kUnlocked, memory_order_release);
+    stats_.releasing();
+    if (state_.exchange(kUnlocked, memory_order_release) == kContended) {
+        parked_.notify_one();
+    }
+}
+
+inline lock_stats mutex::stats() const {
+    return stats_.snapshot();
+}
+
+inline void mutex::lock_contended() {
+    uint64_t wait_start = stats_.begin_wait();
+    
+    // Spin up to twice as long as it has been taking, test and test and set
+    int32_t average = spins_.load(memory_order_relaxed);
+    int32_t limit = std::min< int32_t >(average * 2 + 16, kMaxSpins);
+    for (int32_t spins = 0; spins < limit; ++spins) {
+        uint32_t state = state_.load(memory_order_relaxed);
+        if (state == kUnlocked && state_.compare_exchange_strong(state, kLocked, memory_order_acquire)) {
+            spins_.store(average + (spins - average) / 8, memory_order_relaxed);
+            stats_.acquired(wait_start, false);
+            return;
+        }
+        
+        active_pause();
+    }
+    
+    spins_.store(average + (limit - average) / 8, memory_order_relaxed);
+    
+    // Whoever sees kContended when unlocking wakes one of us. Taking the
+    // lock in that state too means a spare wake up at worst.
+    bool parked = false;
+    while (true) {
+        event_count::key key = parked_.prepare_wait();
+        if (state_.exchange(kContended, memory_order_acquire) == kUnlocked) {
+            parked_.cancel_wait();
+            break;
+        }
+        
+        parked_.wait(key);
+        parked = true;
+    }
+    
+    stats_.acquired(wait_start, parked);
 }
 
 
-#endif // MUTEX_HPP
\ No newline at end of file
+#endif // MUTEX_HPP
@@ -0,0 +1,107 @@
+/*
+ *  parallel_for.hpp
+ *  Task Scheduler
+ *
+ */
+
+// parallel_for(manager, begin, end, body, grain) calls body(first, last) over
+// disjoint sub-ranges covering [begin, end). Ranges are split recursively in
+// half: a task keeps the left half and spawns the right half as a child of
+// the root, until it is down to grain items. With grain 0 the grain is picked
+// so that there are roughly kRangesPerThread ranges per thread, keeping the
+// task count near the thread count rather than the item count.
+//
+// Body must be callable as body(size_t first, size_t last) const and is
+// called concurrently from several threads. Like task_manager::wait, this
+// can only be called on the main thread currently.
+
+#ifndef PARALLEL_FOR_HPP
+#define PARALLEL_FOR_HPP
+
+#include "atomic.hpp"
+#include "task_manager.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace internal
+{
+    enum { kRangesPerThread = 8 };
+
+    template< typename Body >
+    struct parallel_for_state;
+
+    template< typename Body >
+    struct parallel_for_range
+    {
+        parallel_for_state< Body >* state;
+        size_t begin;
+        size_t end;
+    };
+
+    template< typename Body >
+    struct parallel_for_state
+    {
+        task_manager* manager;
+        Body const* body;
+        size_t grain;
+        task_id root;
+        std::vector< parallel_for_range< Body > > ranges;
+        atomic< size_t > next_range;
+    };
+
+    template< typename Body >
+    void parallel_for_task(void* data) {
+        parallel_for_range< Body >* range = static_cast< parallel_for_range< Body >* >(data);
+        parallel_for_state< Body >* state = range->state;
+        size_t begin = range->begin;
+        size_t end = range->end;
+        while (end - begin > state->grain) {
+            size_t middle = begin + (end - begin) / 2;
+            parallel_for_range< Body >* right = &state->ranges[state->next_range++];
+            right->state = state;
+            right->begin = middle;
+            right->end = end;
+
+            // The root can't finish while we (one of its tasks) are running
+            task_id id = state->manager->begin_add(parallel_for_task< Body >, right);
+            state->manager->add_child(state->root, id);
+            state->manager->end_add(id);
+            end = middle;
+        }
+
+        (*state->body)(begin, end);
+    }
+}
+
+template< typename Body >
+void parallel_for(task_manager& manager, size_t begin, size_t end, Body const& body, size_t grain = 0) {
+    if (begin >= end) {
+        return;
+    }
+
+    size_t count = end - begin;
+    if (grain == 0) {
+        size_t threads = manager.num_workers() + 1;
+        grain = std::max< size_t >(count / (threads * internal::kRangesPerThread), 1);
+    }
+
+    // Halving until a range is at most grain long leaves fewer than
+    // 2 * count / grain + 1 ranges
+    internal::parallel_for_state< Body > state;
+    state.manager = &manager;
+    state.body = &body;
+    state.grain = grain;
+    state.ranges.resize(2 * (count / grain) + 2);
+    state.next_range.store(1, memory_order_relaxed);
+
+    internal::parallel_for_range< Body >* first = &state.ranges[0];
+    first->state = &state;
+    first->begin = begin;
+    first->end = end;
+
+    state.root = manager.begin_add(internal::parallel_for_task< Body >, first);
+    manager.end_add(state.root);
+    manager.wait(state.root);
+}
+
+#endif // PARALLEL_FOR_HPP
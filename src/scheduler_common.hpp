@@ -10,23 +10,76 @@
 #ifndef SCHEDULER_COMMON_HPP
 #define SCHEDULER_COMMON_HPP
 
+#include "task_closure.hpp"
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
+#if defined(__linux__)
+#include <sched.h>
+#else
 #include <sys/sysctl.h>
+#endif
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
 
 #define CACHE_LINE_SIZE 64
-
-typedef void (*task_function) (void*);
+#define THREAD_LOCAL __thread
 
 namespace internal
 {
-    struct task
+    // Number of empty polls a worker spins through before it parks
+    enum { kIdleSpinCount = 64 };
+    
+	// Which scheduler, and which of its workers, the calling thread is.
+	// task is the task_manager task the thread is running (null outside of
+	// one) and task_owner the manager it belongs to, task_depth its depth
+	// (0 outside of one) and wait_nesting how many waits the thread is
+	// inside.
+	struct thread_context
 	{
-		task_function func;
-		void* context;
+		void* scheduler;
+		void* worker;
+		void* task;
+		void* task_owner;
+		int32_t task_depth;
+		int32_t wait_nesting;
 	};
 	
+	inline thread_context& current_thread_context() {
+		static THREAD_LOCAL thread_context context = { 0, 0, 0, 0, 0, 0 };
+		return context;
+	}
+	
+	// Monotonic clock in nanoseconds
+	inline uint64_t now_ns() {
+#if defined(__APPLE__)
+		static mach_timebase_info_data_t timebase = { 0, 0 };
+		if (timebase.denom == 0) {
+			mach_timebase_info(&timebase);
+		}
+		
+		return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast< uint64_t >(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+	}
+	
 	// http://stackoverflow.com/questions/150355/programmatically-find-the-number-of-cores-on-a-machine
     int number_of_cores() {
+#if defined(__linux__)
+        // Only count the CPUs we're allowed to run on
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            int numCPU = CPU_COUNT(&set);
+            return numCPU > 0 ? numCPU : 1;
+        }
+        
+        return 1;
+#else
         int numCPU = 0;
         int mib[4];
         size_t len = sizeof(numCPU); 
@@ -48,6 +101,7 @@ namespace internal
         }
         
         return numCPU;
+#endif
     }
 }
 
@@ -0,0 +1,109 @@
+/*
+ *  scheduler_settings.hpp
+ *  Task Scheduler
+ *
+ */
+
+// How long idle threads look for work before they sleep. By default every
+// worker spins through kIdleSpinCount empty polls and then parks, which
+// keeps idle workers off the cpu at the cost of a futex wake, several
+// microseconds, for the first task submitted after a lull. Pipelines that
+// would rather burn a few cores than pay that can have the first
+// spinning_workers workers poll for spin_budget polls with pause and then
+// yield_budget polls with a yield in between before they park, either of
+// which may be kNoLimit. The submit side needs no change: waking is a
+// single load when nobody is parked. Spinning only pays off for workers that
+// have a cpu to themselves.
+//
+// idle_backoff runs the ladder for a thread: call idle() after every empty
+// poll and park once it returns false, reset() after finding work.
+
+#ifndef SCHEDULER_SETTINGS_HPP
+#define SCHEDULER_SETTINGS_HPP
+
+#include "atomic.hpp"
+#include "scheduler_common.hpp"
+#include "thread.hpp"
+#include <stdint.h>
+
+struct scheduler_settings
+{
+    static uint32_t const kNoLimit = 0xffffffffu;
+
+    scheduler_settings()
+    : spinning_workers(0),
+      spin_budget(1 << 16),
+      yield_budget(64),
+      idle_spins(internal::kIdleSpinCount),
+      wait_spins(internal::kIdleSpinCount),
+      affinity_delay_ns(50000) {
+    }
+
+    // Spinning workers that never park. Past the spin budget they yield
+    // between polls, so they don't starve a thread they share a cpu with.
+    static scheduler_settings low_latency(size_t workers) {
+        scheduler_settings settings;
+        settings.spinning_workers = workers;
+        settings.spin_budget = 1 << 12;
+        settings.yield_budget = kNoLimit;
+        settings.wait_spins = 1 << 12;
+        return settings;
+    }
+
+    size_t spinning_workers;    // how many workers, the first ones, spin
+    uint32_t spin_budget;       // empty polls a spinning worker pauses between
+    uint32_t yield_budget;      // then yields between, before parking
+    uint32_t idle_spins;        // empty polls the other workers pause between
+    uint32_t wait_spins;        // and threads waiting for tasks to finish
+    uint32_t affinity_delay_ns; // before other threads may run a task_manager task hinted to a worker
+};
+
+namespace internal
+{
+    class idle_backoff
+    {
+    public:
+
+        idle_backoff(uint32_t spins, uint32_t yields)
+        : spins_(spins),
+          yields_(yields),
+          polls_(0) {
+        }
+
+        // A worker's ladder
+        idle_backoff(scheduler_settings const& settings, size_t worker)
+        : spins_(worker < settings.spinning_workers ? settings.spin_budget : settings.idle_spins),
+          yields_(worker < settings.spinning_workers ? settings.yield_budget : 0),
+          polls_(0) {
+        }
+
+        // After an empty poll. Returns false when it's time to park.
+        bool idle() {
+            ++polls_;
+            if (spins_ == scheduler_settings::kNoLimit || polls_ < spins_) {
+                active_pause();
+                return true;
+            }
+
+            if (yields_ == scheduler_settings::kNoLimit || polls_ - spins_ < yields_) {
+                thread::yield();
+                return true;
+            }
+
+            polls_ = 0;
+            return false;
+        }
+
+        void reset() {
+            polls_ = 0;
+        }
+
+    private:
+
+        uint32_t spins_;
+        uint32_t yields_;
+        uint64_t polls_;
+    };
+}
+
+#endif // SCHEDULER_SETTINGS_HPP
@@ -0,0 +1,182 @@
+/*
+ *  scheduler_stats.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Per-worker scheduler counters. Each worker owns a worker_stats, padded to
+// its own cache lines, and is the only thread that writes it, so updates are
+// a relaxed load and store rather than an atomic RMW. snapshot() reads them
+// while the workers keep running; the totals are consistent per counter but
+// not across counters. Times are only taken when a worker switches between
+// running tasks and being idle, not per task.
+
+#ifndef SCHEDULER_STATS_HPP
+#define SCHEDULER_STATS_HPP
+
+#include "atomic.hpp"
+#include "scheduler_common.hpp"
+#include <algorithm>
+#include <stdint.h>
+
+struct scheduler_stats
+{
+    uint64_t tasks_executed;
+    uint64_t steal_attempts;
+    uint64_t steal_successes;
+    uint64_t failed_polls;      // looked for work and found none
+    uint64_t parks;
+    uint64_t running_ns;
+    uint64_t idle_ns;           // spinning or parked
+    uint64_t parked_ns;
+    uint64_t max_queue_depth;
+
+    scheduler_stats();
+
+    scheduler_stats& operator+=(scheduler_stats const& other);
+};
+
+class worker_stats
+{
+public:
+
+    worker_stats();
+
+    void task_executed() { add(tasks_executed_, 1); }
+
+    void steal_attempt(bool success) {
+        add(steal_attempts_, 1);
+        if (success) {
+            add(steal_successes_, 1);
+        }
+    }
+
+    void failed_poll() { add(failed_polls_, 1); }
+
+    void queue_depth(uint64_t depth) {
+        if (depth > max_queue_depth_.load(memory_order_relaxed)) {
+            max_queue_depth_.store(depth, memory_order_relaxed);
+        }
+    }
+
+    // Marks the switch from running tasks to looking for work and back
+    void begin_idle();
+
+    void end_idle();
+
+    void begin_park();
+
+    void end_park();
+
+    scheduler_stats snapshot() const;
+
+private:
+
+    static void add(atomic< uint64_t >& counter, uint64_t value) {
+        counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+    }
+
+private:
+
+    enum { kCachelineSize = 64 };
+    typedef char cacheline_pad [kCachelineSize];
+
+    cacheline_pad pad0_;
+    atomic< uint64_t > tasks_executed_;
+    atomic< uint64_t > steal_attempts_;
+    atomic< uint64_t > steal_successes_;
+    atomic< uint64_t > failed_polls_;
+    atomic< uint64_t > parks_;
+    atomic< uint64_t > running_ns_;
+    atomic< uint64_t > idle_ns_;
+    atomic< uint64_t > parked_ns_;
+    atomic< uint64_t > max_queue_depth_;
+    uint64_t phase_start_;
+    uint64_t park_start_;
+    bool idle_;
+    cacheline_pad pad1_;
+};
+
+
+inline scheduler_stats::scheduler_stats()
+: tasks_executed(0),
+  steal_attempts(0),
+  steal_successes(0),
+  failed_polls(0),
+  parks(0),
+  running_ns(0),
+  idle_ns(0),
+  parked_ns(0),
+  max_queue_depth(0) {
+}
+
+inline scheduler_stats& scheduler_stats::operator+=(scheduler_stats const& other) {
+    tasks_executed += other.tasks_executed;
+    steal_attempts += other.steal_attempts;
+    steal_successes += other.steal_successes;
+    failed_polls += other.failed_polls;
+    parks += other.parks;
+    running_ns += other.running_ns;
+    idle_ns += other.idle_ns;
+    parked_ns += other.parked_ns;
+    max_queue_depth = std::max(max_queue_depth, other.max_queue_depth);
+    return *this;
+}
+
+inline worker_stats::worker_stats()
+: phase_start_(internal::now_ns()),
+  park_start_(0),
+  idle_(false) {
+    tasks_executed_.store(0, memory_order_relaxed);
+    steal_attempts_.store(0, memory_order_relaxed);
+    steal_successes_.store(0, memory_order_relaxed);
+    failed_polls_.store(0, memory_order_relaxed);
+    parks_.store(0, memory_order_relaxed);
+    running_ns_.store(0, memory_order_relaxed);
+    idle_ns_.store(0, memory_order_relaxed);
+    parked_ns_.store(0, memory_order_relaxed);
+    max_queue_depth_.store(0, memory_order_relaxed);
+}
+
+inline void worker_stats::begin_idle() {
+    if (!idle_) {
+        uint64_t now = internal::now_ns();
+        add(running_ns_, now - phase_start_);
+        phase_start_ = now;
+        idle_ = true;
+    }
+}
+
+inline void worker_stats::end_idle() {
+    if (idle_) {
+        uint64_t now = internal::now_ns();
+        add(idle_ns_, now - phase_start_);
+        phase_start_ = now;
+        idle_ = false;
+    }
+}
+
+inline void worker_stats::begin_park() {
+    add(parks_, 1);
+    park_start_ = internal::now_ns();
+}
+
+inline void worker_stats::end_park() {
+    add(parked_ns_, internal::now_ns() - park_start_);
+}
+
+inline scheduler_stats worker_stats::snapshot() const {
+    scheduler_stats stats;
+    stats.tasks_executed = tasks_executed_.load(memory_order_relaxed);
+    stats.steal_attempts = steal_attempts_.load(memory_order_relaxed);
+    stats.steal_successes = steal_successes_.load(memory_order_relaxed);
+    stats.failed_polls = failed_polls_.load(memory_order_relaxed);
+    stats.parks = parks_.load(memory_order_relaxed);
+    stats.running_ns = running_ns_.load(memory_order_relaxed);
+    stats.idle_ns = idle_ns_.load(memory_order_relaxed);
+    stats.parked_ns = parked_ns_.load(memory_order_relaxed);
+    stats.max_queue_depth = max_queue_depth_.load(memory_order_relaxed);
+    return stats;
+}
+
+#endif // SCHEDULER_STATS_HPP
@@ -10,44 +10,77 @@
 #define SPINLOCK_HPP
 
 #include "atomic.hpp"
+#include "lock_stats.hpp"
+#include <algorithm>
 
+// Test and test and set lock. Waiters spin on a plain load, backing off
+// exponentially between looks, and only retry the exchange once the lock
+// looks free.
 class spin_lock
 {
 public:
     
-    spin_lock()
-    : lock_(0) {
+    spin_lock() {
+        lock_.store(0, memory_order_relaxed);
     }
     
     void lock() {
-        while (true) {
-            if (!exchange32(&lock_, 1)) {
-                return;
-            }
-            
-            while (lock_) {
-                active_pause();
-            }
+        if (lock_.exchange(1, memory_order_acquire) == 0) {
+            stats_.acquired(0, false);
+            return;
         }
+        
+        lock_contended();
     }
     
+    // Returns true if the lock was taken
     bool try_lock() {
-        return exchange32(&lock_, 1);
+        if (lock_.load(memory_order_relaxed) == 0 && lock_.exchange(1, memory_order_acquire) == 0) {
+            stats_.acquired(0, false);
+            return true;
+        }
+        
+        return false;
     }
     
     void unlock() {
-        compiler_barrier();
-        lock_ = 0;
+        stats_.releasing();
+        lock_.store(0, memory_order_release);
+    }
+    
+    // See lock_stats.hpp, all zeroes unless TASK_SCHEDULER_LOCK_STATS is 1
+    lock_stats stats() const {
+        return stats_.snapshot();
     }
     
 private:
     
+    enum { kMaxBackoff = 1024 };
+    
     spin_lock(spin_lock const&);
     spin_lock& operator=(spin_lock const&);
     
+    void lock_contended() {
+        uint64_t wait_start = stats_.begin_wait();
+        uint32_t backoff = 1;
+        do {
+            while (lock_.load(memory_order_relaxed) != 0) {
+                for (uint32_t i = 0; i < backoff; ++i) {
+                    active_pause();
+                }
+                
+                backoff = std::min< uint32_t >(backoff * 2, kMaxBackoff);
+            }
+        }
+        while (lock_.exchange(1, memory_order_acquire) != 0);
+        
+        stats_.acquired(wait_start, false);
+    }
+    
 private:
     
-    int32_t lock_;
+    atomic< uint32_t > lock_;
+    internal::lock_stats_recorder stats_;
 };
 
-#endif //  SPINLOCK_HPP
\ No newline at end of file
+#endif //  SPINLOCK_HPP
@@ -0,0 +1,144 @@
+/*
+ *  spsc_bounded_queue.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Single producer, single consumer ring buffer. Each side keeps a private
+// copy of the other side's index and only reloads it when the copy says
+// the ring is full (producer) or empty (consumer), so as long as the ring
+// is neither the fast path touches no cache line the other side writes.
+
+#ifndef SPSC_BOUNDED_QUEUE_HPP
+#define SPSC_BOUNDED_QUEUE_HPP
+
+#include "atomic.hpp"
+
+template< typename T >
+class spsc_bounded_queue
+{
+public:
+
+	// size must be a power of two
+	spsc_bounded_queue(size_t size)
+	: buffer_(new T[size]),
+	  bufferMask_(size - 1),
+	  headCache_(0),
+	  tailCache_(0) {
+		assert((size >= 2) && ((size & (size - 1)) == 0));
+		tail_.store(0, memory_order_relaxed);
+		head_.store(0, memory_order_relaxed);
+	}
+
+	~spsc_bounded_queue() {
+		delete [] buffer_;
+	}
+
+	// Producer only
+	bool enqueue(T const& data) {
+		size_t tail = tail_.load(memory_order_relaxed);
+		if (tail - headCache_ > bufferMask_) {
+			headCache_ = head_.load(memory_order_acquire);
+			if (tail - headCache_ > bufferMask_) {
+				return false;
+			}
+		}
+
+		buffer_[tail & bufferMask_] = data;
+		tail_.store(tail + 1, memory_order_release);
+
+		return true;
+	}
+
+	// Producer only. Enqueues up to count elements with a single store of
+	// the tail, returns how many fit.
+	size_t enqueue_bulk(T const* first, size_t count) {
+		size_t tail = tail_.load(memory_order_relaxed);
+		size_t free = bufferMask_ + 1 - (tail - headCache_);
+		if (free < count) {
+			headCache_ = head_.load(memory_order_acquire);
+			free = bufferMask_ + 1 - (tail - headCache_);
+		}
+
+		size_t enqueued = count < free ? count : free;
+		for (size_t i = 0; i < enqueued; ++i) {
+			buffer_[(tail + i) & bufferMask_] = first[i];
+		}
+
+		if (enqueued != 0) {
+			tail_.store(tail + enqueued, memory_order_release);
+		}
+
+		return enqueued;
+	}
+
+	// Consumer only
+	bool dequeue(T& data) {
+		size_t head = head_.load(memory_order_relaxed);
+		if (head == tailCache_) {
+			tailCache_ = tail_.load(memory_order_acquire);
+			if (head == tailCache_) {
+				return false;
+			}
+		}
+
+		data = buffer_[head & bufferMask_];
+		head_.store(head + 1, memory_order_release);
+
+		return true;
+	}
+
+	// Consumer only. Dequeues up to max elements with a single store of the
+	// head, returns how many there were.
+	size_t dequeue_bulk(T* out, size_t max) {
+		size_t head = head_.load(memory_order_relaxed);
+		if (tailCache_ - head < max) {
+			tailCache_ = tail_.load(memory_order_acquire);
+		}
+
+		size_t available = tailCache_ - head;
+		size_t dequeued = max < available ? max : available;
+		for (size_t i = 0; i < dequeued; ++i) {
+			out[i] = buffer_[(head + i) & bufferMask_];
+		}
+
+		if (dequeued != 0) {
+			head_.store(head + dequeued, memory_order_release);
+		}
+
+		return dequeued;
+	}
+
+	// Exact for neither side while the other is running, the producer's
+	// view errs high and the consumer's low
+	size_t size() const {
+		size_t head = head_.load(memory_order_acquire);
+		size_t tail = tail_.load(memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	size_t capacity() const {
+		return bufferMask_ + 1;
+	}
+
+private:
+
+	enum { kCachelineSize = 64 };
+	typedef char cacheline_pad [kCachelineSize];
+
+	cacheline_pad pad0_;
+	T* const buffer_;
+	size_t const bufferMask_;
+	cacheline_pad pad1_;
+	atomic< size_t > tail_;
+	size_t headCache_;          // producer's copy of head_
+	cacheline_pad pad2_;
+	atomic< size_t > head_;
+	size_t tailCache_;          // consumer's copy of tail_
+	cacheline_pad pad3_;
+
+	spsc_bounded_queue(spsc_bounded_queue const&);
+	void operator=(spsc_bounded_queue const&);
+};
+
+#endif // SPSC_BOUNDED_QUEUE_HPP
@@ -62,7 +62,7 @@ private:
     {
         node* next_;
         T value_;
-    }
+    };
     
     node* tail_;
     char cache_line_pad_[CACHE_LINE_SIZE];
@@ -0,0 +1,209 @@
+/*
+ *  task_closure.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Type erased, run once callable for tasks. A callable of up to kInlineSize
+// bytes that is trivially copyable (a function pointer and its context, a
+// C++11 lambda capturing pointers and values, ...) is stored in the closure
+// itself, which makes the whole closure one cache line. Anything else is
+// copied into a block from internal::closure_pool and the closure keeps the
+// pointer. Either way a task_closure is itself trivially copyable, so the
+// queues and deques copy it around by value and a thief may read one it
+// then fails to claim. Exactly one copy must be run() (or discard()ed),
+// which is also what releases a pooled callable.
+
+#ifndef TASK_CLOSURE_HPP
+#define TASK_CLOSURE_HPP
+
+#include "index_free_list.hpp"
+#include <cassert>
+#include <new>
+#include <stdint.h>
+
+#if __cplusplus >= 201103L
+#include <type_traits>
+#define TASK_CLOSURE_IS_TRIVIAL(T) (std::is_trivially_copyable< T >::value)
+#elif defined(__GNUC__)
+#define TASK_CLOSURE_IS_TRIVIAL(T) (__has_trivial_copy(T) && __has_trivial_destructor(T))
+#else
+#define TASK_CLOSURE_IS_TRIVIAL(T) false
+#endif
+
+typedef void (*task_function) (void*);
+
+namespace internal
+{
+    // Fixed size blocks for callables too big or too complex to store
+    // inline. The blocks are preallocated on first use and handed out
+    // through a lock-free index_free_list. Callables bigger than a block,
+    // or allocated while the pool is exhausted, fall back to operator new.
+    class closure_pool
+    {
+    public:
+
+        enum { kBlockSize = 256, kNumBlocks = 4096 };
+
+    public:
+
+        static closure_pool& instance();
+
+        void* allocate(size_t size);
+
+        void deallocate(void* block);
+
+    private:
+
+        closure_pool();
+
+        ~closure_pool();
+
+        closure_pool(closure_pool const&);
+        closure_pool& operator=(closure_pool const&);
+
+    private:
+
+        index_free_list free_;
+        char* const blocks_;
+    };
+}
+
+class task_closure
+{
+public:
+
+    enum { kInlineSize = 56 };
+
+public:
+
+    // An empty closure, run() must not be called on it
+    task_closure()
+    : invoke_(0) {
+    }
+
+    // Calls func(context). A null func makes an empty closure.
+    task_closure(task_function func, void* context);
+
+    // Calls a copy of f, f() must be callable
+    template< typename F >
+    explicit task_closure(F const& f);
+
+    bool empty() const { return invoke_ == 0; }
+
+    // Calls the callable and releases it
+    void run() { invoke_(&storage_, true); }
+
+    // Releases the callable without calling it
+    void discard() { invoke_(&storage_, false); }
+
+private:
+
+    struct function_call
+    {
+        task_function func;
+        void* context;
+
+        void operator()() const { func(context); }
+    };
+
+    union storage
+    {
+        char bytes[kInlineSize];
+        void* pointer;
+        double align_double;
+        int64_t align_int64;
+    };
+
+    typedef void (*invoke_func) (storage* data, bool run);
+
+    template< typename F >
+    static void invoke_inline(storage* data, bool run);
+
+    template< typename F >
+    static void invoke_pooled(storage* data, bool run);
+
+private:
+
+    storage storage_;
+    invoke_func invoke_;
+};
+
+
+inline internal::closure_pool& internal::closure_pool::instance() {
+    static closure_pool pool;
+    return pool;
+}
+
+inline internal::closure_pool::closure_pool()
+: free_(kNumBlocks),
+  blocks_(new char[kBlockSize * kNumBlocks]) {
+}
+
+inline internal::closure_pool::~closure_pool() {
+    delete [] blocks_;
+}
+
+inline void* internal::closure_pool::allocate(size_t size) {
+    if (size <= kBlockSize) {
+        int32_t index = free_.pop();
+        if (index != index_free_list::kEmpty) {
+            return blocks_ + index * kBlockSize;
+        }
+    }
+
+    return ::operator new(size);
+}
+
+inline void internal::closure_pool::deallocate(void* block) {
+    char* address = static_cast< char* >(block);
+    if (address >= blocks_ && address < blocks_ + kBlockSize * kNumBlocks) {
+        free_.push(static_cast< int32_t >((address - blocks_) / kBlockSize));
+        return;
+    }
+
+    ::operator delete(block);
+}
+
+inline task_closure::task_closure(task_function func, void* context)
+: invoke_(0) {
+    if (func != 0) {
+        function_call call = { func, context };
+        new (storage_.bytes) function_call(call);
+        invoke_ = &invoke_inline< function_call >;
+    }
+}
+
+template< typename F >
+inline task_closure::task_closure(F const& f) {
+    if (sizeof(F) <= kInlineSize && __alignof__(F) <= __alignof__(storage) && TASK_CLOSURE_IS_TRIVIAL(F)) {
+        new (storage_.bytes) F(f);
+        invoke_ = &invoke_inline< F >;
+    }
+    else {
+        void* block = internal::closure_pool::instance().allocate(sizeof(F));
+        storage_.pointer = new (block) F(f);
+        invoke_ = &invoke_pooled< F >;
+    }
+}
+
+template< typename F >
+inline void task_closure::invoke_inline(storage* data, bool run) {
+    // trivially destructible, nothing to release
+    if (run) {
+        (*reinterpret_cast< F* >(data->bytes))();
+    }
+}
+
+template< typename F >
+inline void task_closure::invoke_pooled(storage* data, bool run) {
+    F* f = static_cast< F* >(data->pointer);
+    if (run) {
+        (*f)();
+    }
+
+    f->~F();
+    internal::closure_pool::instance().deallocate(f);
+}
+
+#endif // TASK_CLOSURE_HPP
@@ -7,90 +7,436 @@
  *
  */
 
-// The idea here is that both the scheduler thread (main thread) and each worker
-// thread has a mpsc queue. Tasks can then be submitted to the scheduler from
-// any thread. After tasks have been submitted, they are then doled out by
-// the scheduler to each worker thread (scheduler dequeue, enqueue worker's queue).
-// Worker threads then dequeue from their local task queue and execute the task.
+// The idea here is that both the scheduler thread and each worker thread has
+// a queue. Tasks can then be submitted to the scheduler from any thread. After
+// tasks have been submitted, they are then doled out by the scheduler to each
+// worker thread (scheduler dequeue, enqueue worker's queue). Worker threads
+// then dequeue from their local task queue and execute the task.
+//
+// That's kDistributorThread mode: a distributor thread moves tasks in batches
+// from the shared queue to per-worker spsc_bounded_queue inboxes, each one
+// to the worker with the fewest tasks queued as of the start of the batch.
+// In kSharedQueue mode, the default, there is no distributor and the
+// workers all dequeue from the shared queue.
+//
+// TaskQueue is mpmc_bounded_queue, whose capacity is the constructor's
+// maxTasks and which asserts when it fills up, or mpmc_unbounded_queue, for
+// which maxTasks is the segment size and submitting never fails.
 
 #ifndef TASK_DISTRIBUTING_SCHEDULER_HPP
 #define TASK_DISTRIBUTING_SCHEDULER_HPP
 
+#include "event_count.hpp"
 #include "mpmc_bounded_queue.hpp"
+#include "mpmc_unbounded_queue.hpp"
 #include "scheduler_common.hpp"
+#include "scheduler_settings.hpp"
+#include "scheduler_stats.hpp"
+#include "spsc_bounded_queue.hpp"
 #include "thread.hpp"
+#include "topology.hpp"
+#include <algorithm>
 #include <vector>
 
-class task_distributing_scheduler
+enum distribution_mode
+{
+	kSharedQueue,
+	kDistributorThread
+};
+
+template< typename TaskQueue >
+class basic_task_distributing_scheduler
 {
 private:
 	
-	typedef mpmc_bounded_queue< internal::task > task_queue;
+	typedef TaskQueue task_queue;
+	typedef spsc_bounded_queue< task_closure > worker_queue;
+	
+	enum { kSubmitBatchSize = 256, kDequeueBatchSize = 8 };
+	enum { kWorkerQueueSize = 256, kDistributeBatchSize = 64 };
 	
 private:
 	
 	struct worker_thread_data
 	{
 		thread thread_;
-		task_distributing_scheduler* scheduler_;
+		basic_task_distributing_scheduler* scheduler_;
+		int index_;
+		bool pin_;
+		worker_stats stats_;
+		worker_queue* inbox_;   // kDistributorThread only
+		event_count wake_;      // signalled by the distributor
 	};
 	
 	static void worker_thread_func(void* data) {
 		worker_thread_data* context = static_cast< worker_thread_data* >(data);
-		while (!context->scheduler_->kill_) {
-			internal::task task;
-			while(context->scheduler_->tasks_.dequeue(task)) {
-				task.func(task.context);
+		basic_task_distributing_scheduler* scheduler = context->scheduler_;
+		if (context->pin_) {
+			cpu_topology::instance().pin_current_thread(context->index_);
+		}
+		
+		internal::idle_backoff backoff(scheduler->settings_, context->index_);
+		while (!scheduler->kill_) {
+			task_closure batch[kDequeueBatchSize];
+			size_t count = scheduler->tasks_.dequeue_bulk(batch, kDequeueBatchSize);
+			if (count != 0) {
+				context->stats_.end_idle();
+				context->stats_.queue_depth(scheduler->tasks_.size() + count);
+				for (size_t i = 0; i < count; ++i) {
+					batch[i].run();
+					context->stats_.task_executed();
+					scheduler->task_finished();
+				}
+				
+				backoff.reset();
+				continue;
 			}
 			
-			thread::sleep(0, 1000);
+			context->stats_.begin_idle();
+			context->stats_.failed_poll();
+			if (backoff.idle()) {
+				continue;
+			}
+			
+			task_closure task;
+			event_count::key key = scheduler->idle_.prepare_wait();
+			if (scheduler->kill_) {
+				scheduler->idle_.cancel_wait();
+				break;
+			}
+			
+			if (scheduler->tasks_.dequeue(task)) {
+				scheduler->idle_.cancel_wait();
+				context->stats_.end_idle();
+				task.run();
+				context->stats_.task_executed();
+				scheduler->task_finished();
+				continue;
+			}
+			
+			context->stats_.begin_park();
+			scheduler->idle_.wait(key);
+			context->stats_.end_park();
+		}
+	}
+	
+	static void inbox_worker_thread_func(void* data) {
+		worker_thread_data* context = static_cast< worker_thread_data* >(data);
+		basic_task_distributing_scheduler* scheduler = context->scheduler_;
+		if (context->pin_) {
+			cpu_topology::instance().pin_current_thread(context->index_);
+		}
+		
+		internal::idle_backoff backoff(scheduler->settings_, context->index_);
+		while (!scheduler->kill_) {
+			task_closure batch[kDequeueBatchSize];
+			size_t count = context->inbox_->dequeue_bulk(batch, kDequeueBatchSize);
+			if (count != 0) {
+				context->stats_.end_idle();
+				context->stats_.queue_depth(context->inbox_->size() + count);
+				for (size_t i = 0; i < count; ++i) {
+					batch[i].run();
+					context->stats_.task_executed();
+					scheduler->task_finished();
+				}
+				
+				backoff.reset();
+				continue;
+			}
+			
+			context->stats_.begin_idle();
+			context->stats_.failed_poll();
+			if (backoff.idle()) {
+				continue;
+			}
+			
+			task_closure task;
+			event_count::key key = context->wake_.prepare_wait();
+			if (scheduler->kill_) {
+				context->wake_.cancel_wait();
+				break;
+			}
+			
+			if (context->inbox_->dequeue(task)) {
+				context->wake_.cancel_wait();
+				context->stats_.end_idle();
+				task.run();
+				context->stats_.task_executed();
+				scheduler->task_finished();
+				continue;
+			}
+			
+			context->stats_.begin_park();
+			context->wake_.wait(key);
+			context->stats_.end_park();
+		}
+	}
+	
+	static void distributor_thread_func(void* data) {
+		basic_task_distributing_scheduler* scheduler = static_cast< basic_task_distributing_scheduler* >(data);
+		task_closure batch[kDistributeBatchSize];
+		size_t count = 0;
+		size_t routed = 0;
+		// spins like the workers it feeds
+		scheduler_settings const& settings = scheduler->settings_;
+		bool spinning = settings.spinning_workers != 0;
+		internal::idle_backoff backoff(spinning ? settings.spin_budget : settings.idle_spins, spinning ? settings.yield_budget : 0);
+		while (!scheduler->kill_) {
+			if (routed == count) {
+				count = scheduler->tasks_.dequeue_bulk(batch, kDistributeBatchSize);
+				routed = 0;
+			}
+			
+			if (count != 0) {
+				routed += scheduler->route(batch + routed, count - routed);
+				if (routed != count) {
+					// every inbox is full
+					active_pause();
+				}
+				
+				backoff.reset();
+				continue;
+			}
+			
+			if (backoff.idle()) {
+				continue;
+			}
+			
+			event_count::key key = scheduler->idle_.prepare_wait();
+			if (scheduler->kill_) {
+				scheduler->idle_.cancel_wait();
+				break;
+			}
+			
+			if (scheduler->tasks_.size() != 0) {
+				scheduler->idle_.cancel_wait();
+				continue;
+			}
+			
+			scheduler->idle_.wait(key);
+		}
+		
+		for (; routed < count; ++routed) {
+			batch[routed].discard();
 		}
 	}
 	
 public:
 	
-	task_distributing_scheduler(size_t maxTasks, size_t numThreads = 0)
-	: tasks_(maxTasks),
+	// See scheduler_settings for spinning workers
+	basic_task_distributing_scheduler(size_t maxTasks, size_t numThreads = 0, distribution_mode mode = kSharedQueue, scheduler_settings const& settings = scheduler_settings())
+	: settings_(settings),
+	  tasks_(maxTasks),
+	  mode_(mode),
 	  kill_(false) {
+		numTasks_.store(0, memory_order_relaxed);
 		if (numThreads == 0) {
 			numThreads = internal::number_of_cores();
 		}
 		
+		// Worker i is pinned to cpu i, unless that would oversubscribe a cpu
+		bool pin = numThreads <= cpu_topology::instance().size();
+		
 		for (int i = 0; i < numThreads; ++i) {
-			worker_thread_data worker;
-			worker.thread_ = thread(worker_thread_func);
-			worker.scheduler_ = this;
+			worker_thread_data* worker = new worker_thread_data;
+			worker->thread_ = thread(mode == kDistributorThread ? inbox_worker_thread_func : worker_thread_func);
+			worker->scheduler_ = this;
+			worker->index_ = i;
+			worker->pin_ = pin;
+			worker->inbox_ = mode == kDistributorThread ? new worker_queue(kWorkerQueueSize) : 0;
 			workers_.push_back(worker);
-			workers_[i].thread_.start(&workers_[i]);
+		}
+		
+		depths_.resize(numThreads);
+		notify_.resize(numThreads);
+		for (int i = 0; i < numThreads; ++i) {
+			workers_[i]->thread_.start(workers_[i]);
+		}
+		
+		if (mode == kDistributorThread) {
+			distributor_ = thread(distributor_thread_func);
+			distributor_.start(this);
 		}
 	}
 	
-	~task_distributing_scheduler() {
+	~basic_task_distributing_scheduler() {
 		kill_ = true;
+		idle_.notify_all();
+		if (mode_ == kDistributorThread) {
+			distributor_.join();
+		}
+		
+		// Tasks that never ran still hold their closures' storage
+		task_closure task;
 		for (int i = 0; i < workers_.size(); ++i) {
-			workers_[i].thread_.join();
+			workers_[i]->wake_.notify_all();
+			workers_[i]->thread_.join();
+			while (workers_[i]->inbox_ != 0 && workers_[i]->inbox_->dequeue(task)) {
+				task.discard();
+			}
+			
+			delete workers_[i]->inbox_;
+			delete workers_[i];
+		}
+		
+		while (tasks_.dequeue(task)) {
+			task.discard();
 		}
 	}
 	
+	// Helps with the shared queue, then waits for every task submitted so
+	// far, including those the distributor has handed to workers, to finish
 	void wait_for_all_tasks() {
-		internal::task task;
-		while(tasks_.dequeue(task)) {
-			task.func(task.context);
+		task_closure task;
+		while (tasks_.dequeue(task)) {
+			task.run();
+			task_finished();
+		}
+		
+		internal::idle_backoff backoff(settings_.wait_spins, 0);
+		while (numTasks_.load(memory_order_acquire) != 0) {
+			if (backoff.idle()) {
+				continue;
+			}
+			
+			event_count::key key = done_.prepare_wait();
+			if (numTasks_.load(memory_order_acquire) == 0) {
+				done_.cancel_wait();
+				break;
+			}
+			
+			done_.wait(key);
 		}
 	}
 	
 	void submit_task(task_function func, void* context) {
-		internal::task task = { func, context };
+		submit(task_closure(func, context));
+	}
+	
+	// Runs a copy of f, see task_closure for how it's stored
+	template< typename F >
+	void submit_task(F const& f) {
+		submit(task_closure(f));
+	}
+	
+	// Submits count tasks running func, one per context. Each batch of
+	// kSubmitBatchSize tasks is published with a single CAS.
+	void submit_tasks(task_function func, void* const* contexts, size_t count) {
+		task_closure batch[kSubmitBatchSize];
+		size_t submitted = 0;
+		while (submitted < count) {
+			size_t size = std::min< size_t >(count - submitted, kSubmitBatchSize);
+			for (size_t i = 0; i < size; ++i) {
+				batch[i] = task_closure(func, contexts[submitted + i]);
+			}
+			
+			numTasks_.fetch_add(size, memory_order_relaxed);
+			size_t enqueued = 0;
+			while (enqueued < size) {
+				size_t success = tasks_.enqueue_bulk(batch + enqueued, size - enqueued);
+				assert(success);
+				if (success == 0) {
+					numTasks_.fetch_sub(size - enqueued, memory_order_relaxed);
+					return;
+				}
+				
+				enqueued += success;
+			}
+			
+			submitted += size;
+			idle_.notify_all();
+		}
+	}
+	
+	// Counters summed over every worker, see scheduler_stats.hpp
+	scheduler_stats snapshot() const {
+		scheduler_stats total;
+		for (size_t i = 0; i < workers_.size(); ++i) {
+			total += workers_[i]->stats_.snapshot();
+		}
+		
+		return total;
+	}
+	
+	scheduler_stats snapshot(size_t worker) const {
+		return workers_[worker]->stats_.snapshot();
+	}
+	
+private:
+	
+	void submit(task_closure const& task) {
+		++numTasks_;
 		bool success = tasks_.enqueue(task);
 		assert(success);
+		idle_.notify_one();
+	}
+	
+	// The final decrement's full barrier pairs with prepare_wait's in
+	// wait_for_all_tasks
+	void task_finished() {
+		if (--numTasks_ == 0) {
+			done_.notify_all();
+		}
+	}
+	
+	// Distributor only. Hands each task to the worker with the shortest
+	// inbox, reading every inbox's depth once per call. Returns how many
+	// were handed out, fewer than count only if every inbox filled up.
+	size_t route(task_closure const* batch, size_t count) {
+		for (size_t i = 0; i < workers_.size(); ++i) {
+			depths_[i] = workers_[i]->inbox_->size();
+			notify_[i] = false;
+		}
+		
+		size_t routed = 0;
+		while (routed < count) {
+			size_t target = 0;
+			for (size_t i = 1; i < workers_.size(); ++i) {
+				if (depths_[i] < depths_[target]) {
+					target = i;
+				}
+			}
+			
+			if (depths_[target] >= kWorkerQueueSize) {
+				break;
+			}
+			
+			if (workers_[target]->inbox_->enqueue(batch[routed])) {
+				++depths_[target];
+				notify_[target] = true;
+				++routed;
+			}
+			else {
+				depths_[target] = kWorkerQueueSize;
+			}
+		}
+		
+		for (size_t i = 0; i < workers_.size(); ++i) {
+			if (notify_[i]) {
+				workers_[i]->wake_.notify_one();
+			}
+		}
+		
+		return routed;
 	}
 	
 private:
 	
+	scheduler_settings const settings_;
 	task_queue tasks_;
-	std::vector< worker_thread_data > workers_;
-	bool kill_;
+	std::vector< worker_thread_data* > workers_;
+	event_count idle_;      // workers park here, or the distributor if there is one
+	atomic< size_t > numTasks_;     // submitted and not yet finished
+	event_count done_;      // wait_for_all_tasks parks here
+	distribution_mode const mode_;
+	thread distributor_;
+	std::vector< size_t > depths_;  // distributor only
+	std::vector< bool > notify_;
+	bool volatile kill_;
 };
 
+typedef basic_task_distributing_scheduler< mpmc_bounded_queue< task_closure > > task_distributing_scheduler;
+typedef basic_task_distributing_scheduler< mpmc_unbounded_queue< task_closure > > unbounded_task_distributing_scheduler;
+
 
 #endif // TASK_DISTRIBUTING_SCHEDULER_HPP
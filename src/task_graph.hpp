@@ -0,0 +1,277 @@
+/*
+ *  task_graph.hpp
+ *  Task Scheduler
+ *
+ */
+
+// A dependency graph built once and run any number of times with
+// task_manager::launch, for work whose shape is the same every frame.
+// Nodes, edges and predecessor counts are laid out in flat arrays when the
+// graph is built, and each node owns the task_t that goes through the
+// scheduler's queues, so a launch only resets one counter per node and
+// pushes the roots in a single bulk push per priority. No task ids are
+// allocated and nothing is parented or released through open_tasks.
+//
+// Nodes are plain functions called with the context of the current run and
+// their own index. A graph runs once at a time: launch it again, change it
+// or destroy it only after wait(graph) has returned.
+//
+// Roots launched from outside the pool go through the shared queue, which
+// holds as many tasks as the manager was created for. Any more wait in a
+// slower locked list, so size the manager for the widest graph if it's
+// launched from outside.
+
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include "atomic.hpp"
+#include "task_manager.hpp"
+#include <utility>
+#include <vector>
+
+// Called with the context passed to launch and the node's index
+typedef void (*graph_task_func) (void* context, int32_t node);
+
+class task_graph
+{
+public:
+
+    typedef int32_t node_id;
+
+    task_graph()
+    : nodes_(0),
+      context_(0),
+      manager_(0),
+      remaining_(0),
+      built_(true) {
+    }
+
+    ~task_graph() {
+        assert(!running());
+        delete [] nodes_;
+    }
+
+    node_id add_node(graph_task_func func, task_priority priority = kPriorityNormal) {
+        assert(!running());
+        funcs_.push_back(func);
+        priorities_.push_back(priority);
+        built_ = false;
+        return static_cast< node_id >(funcs_.size() - 1);
+    }
+
+    // dependent won't start until node has finished, in every run
+    void add_dependency(node_id node, node_id dependent) {
+        assert(!running());
+        assert(node != dependent);
+        edges_.push_back(std::make_pair(node, dependent));
+        built_ = false;
+    }
+
+    size_t size() const {
+        return funcs_.size();
+    }
+
+    bool running() const {
+        return remaining_ != 0;
+    }
+
+    // Lays out the flat arrays. launch does this if the graph has changed
+    // since, call it beforehand to keep it out of the first run.
+    void build();
+
+private:
+
+    friend class task_manager;
+
+    struct node
+    {
+        task_t task;            // id is kNullTask, the closure calls run_node
+        task_graph* graph;
+        node_id index;
+    };
+
+    // Predicate for help_until
+    struct run_finished
+    {
+        task_graph const* graph;
+
+        bool operator()() const { return !graph->running(); }
+    };
+
+    // Resets the counters for a run
+    void start(task_manager* manager, void* context, int32_t depth);
+
+    static void run_node(void* data);
+
+    // Releases index's successors and ends the run if it was the last node
+    void finish(node_id index);
+
+    bool acyclic() const;
+
+private:
+
+    // as added
+    std::vector< graph_task_func > funcs_;
+    std::vector< task_priority > priorities_;
+    std::vector< std::pair< node_id, node_id > > edges_;
+
+    // as built: node i's successors are successors_[successorOffsets_[i],
+    // successorOffsets_[i + 1]), the roots of priority p are
+    // roots_[rootOffsets_[p], rootOffsets_[p + 1])
+    node* nodes_;
+    std::vector< int32_t > predecessors_;
+    std::vector< int32_t > successorOffsets_;
+    std::vector< node_id > successors_;
+    std::vector< task_t* > roots_;
+    size_t rootOffsets_[kNumPriorities + 1];
+
+    // the current run
+    void* context_;
+    task_manager* manager_;
+    int32_t volatile remaining_;
+
+    bool built_;
+
+    task_graph(task_graph const&);
+    void operator=(task_graph const&);
+};
+
+inline void task_graph::build() {
+    assert(!running());
+    assert(acyclic());
+    size_t count = funcs_.size();
+
+    predecessors_.assign(count, 0);
+    successorOffsets_.assign(count + 1, 0);
+    for (size_t i = 0; i < edges_.size(); ++i) {
+        ++successorOffsets_[edges_[i].first + 1];
+        ++predecessors_[edges_[i].second];
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        successorOffsets_[i + 1] += successorOffsets_[i];
+    }
+
+    std::vector< int32_t > cursor(successorOffsets_.begin(), successorOffsets_.end() - 1);
+    successors_.resize(edges_.size());
+    for (size_t i = 0; i < edges_.size(); ++i) {
+        successors_[cursor[edges_[i].first]++] = edges_[i].second;
+    }
+
+    delete [] nodes_;
+    nodes_ = new node[count];
+    for (size_t i = 0; i < count; ++i) {
+        node& n = nodes_[i];
+        task_initialize(&n.task);
+        n.task.generation = 0;
+        n.task.work = task_closure(run_node, &n);
+        n.task.priority = priorities_[i];
+        n.graph = this;
+        n.index = static_cast< node_id >(i);
+    }
+
+    roots_.clear();
+    for (int level = 0; level < kNumPriorities; ++level) {
+        rootOffsets_[level] = roots_.size();
+        for (size_t i = 0; i < count; ++i) {
+            if (predecessors_[i] == 0 && priorities_[i] == level) {
+                roots_.push_back(&nodes_[i].task);
+            }
+        }
+    }
+
+    rootOffsets_[kNumPriorities] = roots_.size();
+    built_ = true;
+}
+
+inline void task_graph::start(task_manager* manager, void* context, int32_t depth) {
+    assert(!running());
+    if (!built_) {
+        build();
+    }
+
+    for (size_t i = 0; i < funcs_.size(); ++i) {
+        nodes_[i].task.unfinished_dependencies = predecessors_[i];
+        nodes_[i].task.depth = depth;
+    }
+
+    manager_ = manager;
+    context_ = context;
+    remaining_ = static_cast< int32_t >(funcs_.size());
+}
+
+// A closure of a plain function can be run any number of times
+inline void task_graph::run_node(void* data) {
+    node* self = static_cast< node* >(data);
+    task_graph* graph = self->graph;
+    graph->funcs_[self->index](graph->context_, self->index);
+    graph->finish(self->index);
+}
+
+inline void task_graph::finish(node_id index) {
+    task_manager* manager = manager_;
+    for (int32_t i = successorOffsets_[index]; i < successorOffsets_[index + 1]; ++i) {
+        task_t* successor = &nodes_[successors_[i]].task;
+        if (atomic_decrement(successor->unfinished_dependencies) == 0) {
+            manager->trace(internal::kTraceRelease, kNullTask);
+            manager->push_ready(successor);
+        }
+    }
+
+    // The graph may be relaunched or gone as soon as this hits zero, and
+    // waking costs little when nobody is parked
+    if (atomic_decrement(remaining_) == 0) {
+        manager->wake_helpers();
+    }
+}
+
+// Kahn's algorithm, for the assert in build: a cycle would never finish
+inline bool task_graph::acyclic() const {
+    size_t count = funcs_.size();
+    std::vector< int32_t > pending(count, 0);
+    std::vector< std::vector< node_id > > successors(count);
+    for (size_t i = 0; i < edges_.size(); ++i) {
+        ++pending[edges_[i].second];
+        successors[edges_[i].first].push_back(edges_[i].second);
+    }
+
+    std::vector< node_id > ready;
+    for (size_t i = 0; i < count; ++i) {
+        if (pending[i] == 0) {
+            ready.push_back(static_cast< node_id >(i));
+        }
+    }
+
+    size_t visited = 0;
+    while (!ready.empty()) {
+        node_id current = ready.back();
+        ready.pop_back();
+        ++visited;
+        for (size_t i = 0; i < successors[current].size(); ++i) {
+            if (--pending[successors[current][i]] == 0) {
+                ready.push_back(successors[current][i]);
+            }
+        }
+    }
+
+    return visited == count;
+}
+
+inline void task_manager::launch(task_graph& graph, void* context) {
+    graph.start(this, context, internal::current_thread_context().task_depth + 1);
+    for (int level = 0; level < kNumPriorities; ++level) {
+        size_t first = graph.rootOffsets_[level];
+        push_ready_bulk(graph.roots_.empty() ? 0 : &graph.roots_[0] + first, graph.rootOffsets_[level + 1] - first, static_cast< task_priority >(level));
+    }
+}
+
+inline void task_manager::wait(task_graph& graph) {
+    task_graph::run_finished done = { &graph };
+    if (done()) {
+        return;
+    }
+
+    help_until(done);
+}
+
+#endif // TASK_GRAPH_HPP
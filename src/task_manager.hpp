@@ -1,145 +1,321 @@
 #ifndef TASK_HPP
 #define TASK_HPP
 
+#include "event_count.hpp"
+#include "index_free_list.hpp"
 #include "spin_lock.hpp"
 #include "mpmc_bounded_queue.hpp"
-#include "mpsc_queue.hpp"
+#include "scheduler_common.hpp"
+#include "scheduler_settings.hpp"
+#include "scheduler_stats.hpp"
+#include "task_closure.hpp"
 #include "thread.hpp"
-#include <queue>
+#include "topology.hpp"
+#include "trace.hpp"
+#include "work_stealing_deque.hpp"
+#include <deque>
 #include <vector>
 #include <iostream>
 
 typedef int32_t task_id;
 enum { kNullTask = -1 };
+enum { kAnyWorker = -1 };
+
+// Workers always look for higher priority work first, except that every
+// kAgingInterval-th pick looks at the lower levels first so a steady stream
+// of high priority tasks can't starve background work.
+enum task_priority
+{
+    kPriorityHigh = 0,
+    kPriorityNormal,
+    kPriorityBackground,
+    kNumPriorities
+};
 
 typedef void (*cpu_task_func) (void* context);
 
-union task_work_item
+// Names one run of a task id, so cancelling or depending on it through this
+// does nothing once that task has finished and the id has been reused, see
+// task_manager::cancel and add_dependency
+struct cancellation_token
 {
-    struct { cpu_task_func func; void* context; } cpu_work;
+    task_id id;
+    uint32_t generation;
 };
 
+class task_graph;
+
 struct task_t
 {
     task_id id;
-    task_work_item work;
+    task_closure work;      // empty for tasks that only group children
     task_id parent;
-    int32_t open_work_items;
-    task_id depends_on;
+    task_priority priority;
+    int32_t depth;          // one more than the task that created it, 1 at top level
+    
+    // The worker the task goes to when it's ready, kAnyWorker for the
+    // shared queues. Only that worker runs a pinned task; others may run a
+    // hinted one once it has waited for a while, see begin_add.
+    int32_t affinity;
+    bool pinned;
+    int32_t volatile open_work_items;
+    
+    // Set by wait(), finishing the task then wakes parked waiters. The
+    // generation changes every time the slot is recycled.
+    bool volatile has_waiters;
+    uint32_t volatile generation;
+    
+    // generation + 1 once the task has been cancelled, so a late cancel of
+    // the slot's previous task doesn't stick
+    uint32_t volatile cancelled;
+    
+    // Join counter: one per unfinished predecessor, plus one held until
+    // end_add. Whoever drops it to zero makes the task runnable.
+    int32_t volatile unfinished_dependencies;
+    
+    // Tasks waiting on this one. Once finished is set (under the lock)
+    // no more successors can be added and the list is read lock free.
+    spin_lock successors_lock;
+    bool finished;
+    std::vector< task_id > successors;
 };
 
 void task_initialize(task_t* task) {
     task->id = kNullTask;
-    task->work.cpu_work.func = 0;
-    task->work.cpu_work.context = 0;
+    task->work = task_closure();
+    task->priority = kPriorityNormal;
+    task->depth = 0;
+    task->affinity = kAnyWorker;
+    task->pinned = false;
     task->open_work_items = 0;
-    task->depends_on = kNullTask;
+    task->has_waiters = false;
+    task->parent = kNullTask;
+    task->cancelled = 0;
+    task->unfinished_dependencies = 0;
+    task->finished = false;
+    task->successors.clear();
 }
 
 class task_manager
 {    
 private:
+    
+    enum { kAgingInterval = 32 };
+    
+    // How many waits a thread may nest inside each other while still running
+    // arbitrary tasks, see find_task_while_waiting
+    enum { kMaxWaitNesting = 16 };
+    
+    // Tasks sent to one worker. Pinned ones only ever leave through the
+    // owner, hinted ones also through other threads once they've waited
+    // settings_.affinity_delay_ns. The counts let empty boxes be passed over
+    // without taking the lock.
+    struct mailbox
+    {
+        struct letter
+        {
+            task_t* task;
+            uint64_t posted_ns;
+        };
+        
+        spin_lock lock;
+        std::deque< task_t* > pinned[kNumPriorities];
+        std::deque< letter > hinted[kNumPriorities];
+        int32_t volatile size;
+        int32_t volatile hinted_size;
+    };
 
 	struct worker_thread_data
 	{
 		thread thread_;
+        work_stealing_deque< task_t* > tasks_[kNumPriorities];
 		task_manager* scheduler_;
+        int index_;
+        bool pin_;
+        std::vector< int > steal_order_;
+        uint32_t picks_;
+        mailbox mailbox_;
+        worker_stats stats_;
+        internal::trace_buffer trace_;
 	};
     
-    // this function needs to be rewritten!
 	static void worker_thread_func(void* data) {
-		task_manager* context = static_cast< task_manager* >(data);
+        worker_thread_data* worker = static_cast< worker_thread_data* >(data);
+		task_manager* context = worker->scheduler_;
+        internal::thread_context& current = internal::current_thread_context();
+        current.scheduler = context;
+        current.worker = worker;
+        if (worker->pin_) {
+            cpu_topology::instance().pin_current_thread(worker->index_ + 1);
+        }
+        
+        internal::idle_backoff backoff(context->settings_, worker->index_);
 		while (!context->kill) {
 			task_t* run = 0;
-            while (context->tasks.dequeue(run) == true) {
-                if (context->kill) {
-                    return;
-                }
-                
-                if (run->work.cpu_work.func) {
-                    run->work.cpu_work.func(run->work.cpu_work.context);
+            if (context->find_task(worker, run) == true) {
+                worker->stats_.end_idle();
+                context->execute(run);
+                worker->stats_.task_executed();
+                backoff.reset();
+                continue;
+            }
+            
+            worker->stats_.begin_idle();
+            worker->stats_.failed_poll();
+            if (backoff.idle()) {
+                continue;
+            }
+            
+            // Out of work, park until end_add or a dependency release wakes us
+            event_count::key key = context->idle.prepare_wait();
+            if (context->kill) {
+                context->idle.cancel_wait();
+                return;
+            }
+            
+            if (context->find_task(worker, run) == true) {
+                context->idle.cancel_wait();
+                worker->stats_.end_idle();
+                context->execute(run);
+                worker->stats_.task_executed();
+                continue;
+            }
+            
+            // Nothing would wake us when another worker's hinted tasks
+            // become ours to take, so sleep no longer than the oldest one
+            // has left to wait
+            uint64_t timeout = 0;
+            uint64_t due = context->hinted_due(worker);
+            if (due != 0) {
+                uint64_t now = internal::now_ns();
+                if (due <= now) {
+                    context->idle.cancel_wait();
+                    continue;
                 }
                 
-                context->decrement_task(run->id);
+                timeout = due - now;
             }
-
-			thread::sleep(0, 1000);
+            
+            worker->stats_.begin_park();
+            worker->trace_.record(internal::kTraceParkBegin, 0);
+            context->idle.wait(key, worker_mask(worker->index_), timeout);
+            worker->trace_.record(internal::kTraceParkEnd, 0);
+            worker->stats_.end_park();
 		}
 	}
 	
 public:
     
-    task_manager(size_t maxTasks, size_t numThreads = -1)
-    : tasks(maxTasks),
+    // See scheduler_settings for spinning workers
+    task_manager(size_t maxTasks, size_t numThreads = -1, scheduler_settings const& settings = scheduler_settings())
+    : settings_(settings),
+      availableIds(maxTasks),
       max_tasks(maxTasks),
       num_tasks(0),
-	  kill(false),
-      waiting_on_task(false) {
+	  kill(false) {
+        overflow_size_.store(0, memory_order_relaxed);
+        
 		if (numThreads == -1) {
 			numThreads = internal::number_of_cores() - 1;
 		}
         
+        // Workers are pinned to cpus 1..numThreads, leaving cpu 0 for the
+        // thread that calls wait(), unless that would oversubscribe a cpu.
+        cpu_topology const& topology = cpu_topology::instance();
+        bool pin = numThreads + 1 <= topology.size();
+        
+        for (int level = 0; level < kNumPriorities; ++level) {
+            tasks[level] = new mpmc_bounded_queue< task_t* >(maxTasks);
+        }
+        
         open_tasks = new task_t[maxTasks];
         for (int i = 0; i < maxTasks; ++i) {
-            availableIds.push(i);
             task_initialize(&open_tasks[i]);
+            open_tasks[i].generation = 0;
         }
           
 		for (int i = 0; i < numThreads; ++i) {
-			worker_thread_data worker;
-			worker.thread_ = thread(worker_thread_func);
-			worker.scheduler_ = this;
+			worker_thread_data* worker = new worker_thread_data;
+			worker->thread_ = thread(worker_thread_func);
+			worker->scheduler_ = this;
+            worker->index_ = i;
+            worker->pin_ = pin;
+            worker->steal_order_ = topology.steal_order(i, numThreads, 1);
+            worker->picks_ = 0;
+            worker->mailbox_.size = 0;
+            worker->mailbox_.hinted_size = 0;
 			workers_.push_back(worker);
-			workers_[i].thread_.start(this);
 		}
+          
+        for (int i = 0; i < numThreads; ++i) {
+            workers_[i]->thread_.start(workers_[i]);
+        }
 	}
     
     ~task_manager() {
         stop();
         assert(num_tasks == 0);
-        delete [] open_tasks;
-        mpsc_queue< task_id >::node* n = 0;
-        while ((n = availableIds.pop()) != 0) {
-            delete n;
-            n = 0;
+        for (int i = 0; i < workers_.size(); ++i) {
+            delete workers_[i];
         }
+        
+        for (int level = 0; level < kNumPriorities; ++level) {
+            delete tasks[level];
+        }
+        
+        delete [] open_tasks;
     }
     
     // Help functions
-    void add(cpu_task_func func, void* context) {
-        end_add(begin_add(func, context));
+    void add(cpu_task_func func, void* context, task_priority priority = kPriorityNormal) {
+        end_add(begin_add(func, context, priority));
     }
     
-    task_id begin_add(cpu_task_func func, void* context) {
-        atomic_increment(num_tasks);        
-        mpsc_queue< task_id >::node* popped = availableIds.pop();
-        assert(popped != 0);
-        task_id id = popped->value;
-        delete popped;
-        
-        task_t* newtask = &open_tasks[id];
-        assert(newtask->id == kNullTask);
-        newtask->id = id;
-        
-        newtask->work.cpu_work.func = func;
-        newtask->work.cpu_work.context = context;
-        newtask->parent = kNullTask;
-        newtask->open_work_items = 2;
-        newtask->depends_on = kNullTask;
-        
-        return newtask->id;
+    template< typename F >
+    void add(F const& f, task_priority priority = kPriorityNormal) {
+        end_add(begin_add(f, priority));
+    }
+    
+    // affinity is a hint: the task goes to that worker when it's ready and
+    // other threads only take it after settings_.affinity_delay_ns, so data
+    // it shares with the worker's other tasks stays in that worker's cache.
+    task_id begin_add(cpu_task_func func, void* context, task_priority priority = kPriorityNormal, int32_t affinity = kAnyWorker) {
+        return create_task(task_closure(func, context), priority, affinity, false);
+    }
+    
+    // Runs a copy of f, see task_closure for how it's stored
+    template< typename F >
+    task_id begin_add(F const& f, task_priority priority = kPriorityNormal, int32_t affinity = kAnyWorker) {
+        return create_task(task_closure(f), priority, affinity, false);
+    }
+    
+    // A task that only the given worker runs, for ones that use what that
+    // worker keeps to itself. It's never stolen, not even by a thread
+    // waiting for it. Every parked worker is woken when it's ready, as only
+    // the one given can run it.
+    task_id begin_add_to(size_t worker, cpu_task_func func, void* context, task_priority priority = kPriorityNormal) {
+        return create_task(task_closure(func, context), priority, static_cast< int32_t >(worker), true);
+    }
+    
+    template< typename F >
+    task_id begin_add_to(size_t worker, F const& f, task_priority priority = kPriorityNormal) {
+        return create_task(task_closure(f), priority, static_cast< int32_t >(worker), true);
+    }
+    
+    void submit_to(size_t worker, cpu_task_func func, void* context, task_priority priority = kPriorityNormal) {
+        end_add(begin_add_to(worker, func, context, priority));
+    }
+    
+    template< typename F >
+    void submit_to(size_t worker, F const& f, task_priority priority = kPriorityNormal) {
+        end_add(begin_add_to(worker, f, priority));
     }
     
     void end_add(task_id id) {
         task_t* task = &open_tasks[id];
         decrement_task(id);
-        if (task->depends_on == kNullTask) {
-            tasks.enqueue(task);
-        }
-        else {
-            dependency_lock.lock();
-            dependents_hold.push_back(task);
-            dependency_lock.unlock();
+        if (atomic_decrement(task->unfinished_dependencies) == 0) {
+            push_ready(task);
         }
     }
     
@@ -148,60 +324,684 @@ public:
         task_t* child = &open_tasks[childid];
         
         assert(child->parent == kNullTask);
-        //assert(child->dependency == kNullTask);
         child->parent = parentid;
         atomic_increment(parent->open_work_items);
     }
     
+    // dependentid won't run until taskid and all of its children have
+    // finished. A task may depend on any number of others. Must be called
+    // before end_add(dependentid), and while taskid is still open: ids are
+    // reused as soon as their task finishes, so a finished taskid may name
+    // an unrelated task by now, or dependentid itself. Take a token while
+    // the task is open when it may finish first.
     void add_dependency(task_id taskid, task_id dependentid) {
+        assert(taskid != dependentid);
+        add_dependency(token(taskid), dependentid);
+    }
+    
+    // As above, but does nothing once the token's task has finished, even
+    // when its id has been reused.
+    void add_dependency(cancellation_token const& token, task_id dependentid) {
+        task_t* task = &open_tasks[token.id];
         task_t* dependent = &open_tasks[dependentid];
-        assert(dependent->depends_on == kNullTask);
-        dependent->depends_on = taskid;
+        
+        // Slots are recycled under the lock, so a matching generation here
+        // means the task is this run's, finished or not.
+        task->successors_lock.lock();
+        if (task->generation == token.generation && !task->finished) {
+            atomic_increment(dependent->unfinished_dependencies);
+            task->successors.push_back(dependentid);
+        }
+        task->successors_lock.unlock();
     }
     
-    // Can only be called on the main thread currently
-    void wait(task_id id) {
-        if (!waiting_on_task) {
-            waiting_on_task = true;
+    // Skips the task and every child of it that hasn't started running, as
+    // though they had run: wait() returns and dependents run as usual.
+    // Running ones carry on, they can poll cancelled() to stop early. Any
+    // thread may cancel, with a token taken while the task was open or with
+    // the id while it's still open (before end_add, or from one of its
+    // children).
+    void cancel(cancellation_token const& token) {
+        // cancelled is read before the generation is checked, so it holds
+        // 0 or a mark of this run, never one for whatever reuses the slot,
+        // and the exchange can't overwrite such a mark.
+        task_t* task = &open_tasks[token.id];
+        uint32_t mark = token.generation + 1;
+        uint32_t seen = task->cancelled;
+        while (task->generation == token.generation && seen != mark) {
+            if (atomic_compare_exchange(const_cast< uint32_t& >(task->cancelled), seen, mark)) {
+                return;
+            }
+        }
+    }
+    
+    void cancel(task_id id) {
+        cancel(token(id));
+    }
+    
+    cancellation_token token(task_id id) const {
+        cancellation_token token = { id, open_tasks[id].generation };
+        return token;
+    }
+    
+    // Whether the task the calling thread is running, or one of its
+    // ancestors, has been cancelled. A load per ancestor, cheap enough to
+    // poll in a loop. False outside of a task of this manager.
+    bool cancelled() const {
+        internal::thread_context const& current = internal::current_thread_context();
+        if (current.task_owner != this) {
+            return false;
         }
         
+        return cancelled(static_cast< task_t const* >(current.task));
+    }
+    
+    // Waits until id and all of its children have finished. May be called
+    // from any thread, including from inside a running task; the caller runs
+    // other tasks meanwhile and parks when there are none, see help_until.
+    void wait(task_id id) {
         task_t* task = &open_tasks[id];
-        while (task->open_work_items > 0) {
-            // help out
+        task_finished done = { task, task->generation };
+        if (done()) {
+            return;
+        }
+        
+        // paired with the full barriers of prepare_wait and of the final
+        // decrement of open_work_items in decrement_task
+        task->has_waiters = true;
+        help_until(done);
+    }
+    
+    // Runs ready tasks on the calling thread until done() returns true,
+    // parking when there's nothing to run for wait_spins polls, see
+    // scheduler_settings. Whatever makes done() true must
+    // call wake_helpers() afterwards. Waiters park apart from idle workers,
+    // so finishing a task doesn't wake those, and new work only wakes a
+    // waiter when no idle worker is left to take it.
+    //
+    // Inside a task only tasks deeper than the running one are helped with
+    // first, and past kMaxWaitNesting nested waits nothing else is run, so a
+    // chain of waits can't grow the stack without bound. Such a thread polls
+    // instead of parking: the tasks it would be woken for aren't ones it
+    // may run.
+    template< typename Predicate >
+    void help_until(Predicate const& done) {
+        internal::thread_context& current = internal::current_thread_context();
+        worker_thread_data* worker = local_worker();
+        ++current.wait_nesting;
+        internal::idle_backoff backoff(settings_.wait_spins, 0);
+        size_t requeues = shared_size();
+        while (!done()) {
             task_t* run = 0;
-            if (tasks.dequeue(run) == true) {
-                if (run->work.cpu_work.func) {
-                    run->work.cpu_work.func(run->work.cpu_work.context);
+            if (find_task_while_waiting(worker, current, run, requeues) == true) {
+                execute(run);
+                if (worker != 0) {
+                    worker->stats_.task_executed();
                 }
-
-                decrement_task(run->id);
+                
+                requeues = shared_size();
+                backoff.reset();
+                continue;
+            }
+            
+            if (backoff.idle()) {
+                continue;
+            }
+            
+            if (current.wait_nesting > kMaxWaitNesting) {
+                thread::yield();
+                continue;
             }
             
-            evaluate_dependencies();
+            event_count::key key = waiting.prepare_wait();
+            if (done()) {
+                waiting.cancel_wait();
+                break;
+            }
+            
+            if (find_task_while_waiting(worker, current, run, requeues) == true) {
+                waiting.cancel_wait();
+                execute(run);
+                if (worker != 0) {
+                    worker->stats_.task_executed();
+                }
+                
+                continue;
+            }
+            
+            if (worker != 0) {
+                worker->stats_.begin_park();
+            }
+            
+            trace(internal::kTraceParkBegin, 0);
+            waiting.wait(key);
+            trace(internal::kTraceParkEnd, 0);
+            if (worker != 0) {
+                worker->stats_.end_park();
+            }
+        }
+        
+        --current.wait_nesting;
+    }
+    
+    // Runs a prebuilt graph with the given context, see task_graph.hpp
+    void launch(task_graph& graph, void* context);
+    
+    // Waits for the graph's current run like wait(id) does for a task
+    void wait(task_graph& graph);
+    
+    void wake_helpers() {
+        waiting.notify_all();
+    }
+    
+    size_t num_workers() const {
+        return workers_.size();
+    }
+    
+    // Counters summed over every worker, see scheduler_stats.hpp
+    scheduler_stats snapshot() const {
+        scheduler_stats total;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            total += workers_[i]->stats_.snapshot();
         }
         
-        waiting_on_task = false;
+        return total;
+    }
+    
+    scheduler_stats snapshot(size_t worker) const {
+        return workers_[worker]->stats_.snapshot();
+    }
+    
+    // Writes the last internal::kTraceCapacity events of each worker, and of
+    // all other threads together, as Chrome trace event JSON, one track per
+    // thread. Empty unless TASK_SCHEDULER_TRACE is 1, see trace.hpp.
+    void write_trace(std::ostream& out) const {
+#if TASK_SCHEDULER_TRACE
+        std::vector< internal::trace_buffer const* > buffers;
+        std::vector< std::string > names;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "worker %zu", i);
+            buffers.push_back(&workers_[i]->trace_);
+            names.push_back(name);
+        }
+        
+        buffers.push_back(&external_trace_);
+        names.push_back("other thread");
+        internal::write_chrome_trace(out, buffers, names, trace_clock_);
+#else
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}\n";
+#endif
     }
     
     void stop() {
         kill = true;
+        idle.notify_all();
         for (int i = 0; i < workers_.size(); ++i) {
-            workers_[i].thread_.join();
+            workers_[i]->thread_.join();
         }
     }
     
 private:
     
+    friend class task_graph;
+    
+    task_id create_task(task_closure const& work, task_priority priority, int32_t affinity, bool pinned) {
+        assert(affinity == kAnyWorker || (affinity >= 0 && affinity < static_cast< int32_t >(workers_.size())));
+        atomic_increment(num_tasks);        
+        task_id id = availableIds.pop();
+        assert(id != index_free_list::kEmpty);
+        
+        task_t* newtask = &open_tasks[id];
+        assert(newtask->id == kNullTask);
+        newtask->id = id;
+        
+        newtask->work = work;
+        newtask->parent = kNullTask;
+        newtask->priority = priority;
+        newtask->affinity = affinity;
+        newtask->pinned = pinned;
+        newtask->depth = internal::current_thread_context().task_depth + 1;
+        newtask->open_work_items = 2;
+        newtask->unfinished_dependencies = 1;
+        
+        return newtask->id;
+    }
+    
+    // The calling thread's worker, or null if it isn't one of ours
+    worker_thread_data* local_worker() {
+        internal::thread_context& current = internal::current_thread_context();
+        if (current.scheduler == this) {
+            return static_cast< worker_thread_data* >(current.worker);
+        }
+        
+        return 0;
+    }
+    
+    // Workers keep what they spawn or release on their own deque, other
+    // threads go through the shared queue.
+    void push_ready(task_t* task) {
+        if (task->affinity != kAnyWorker) {
+            post(task);
+            return;
+        }
+        
+        worker_thread_data* worker = local_worker();
+        if (worker != 0) {
+            worker->tasks_[task->priority].push(task);
+            worker->stats_.queue_depth(worker->tasks_[task->priority].size());
+        }
+        else {
+            enqueue_shared(task);
+        }
+        
+        notify_work();
+    }
+    
+    void notify_work() {
+        if (!idle.notify_one()) {
+            waiting.notify_one();
+        }
+    }
+    
+    void notify_all_work() {
+        idle.notify_all();
+        waiting.notify_all();
+    }
+    
+    // Roughly how many tasks the shared queues hold
+    size_t shared_size() const {
+        size_t size = overflow_size_.load(memory_order_relaxed);
+        for (int level = 0; level < kNumPriorities; ++level) {
+            size += tasks[level]->size();
+        }
+        
+        return size;
+    }
+    
+    // Tasks with ids can't outnumber the shared queue's capacity, graph
+    // nodes can: those that don't fit wait in overflow instead
+    void enqueue_shared(task_t* task) {
+        if (!tasks[task->priority]->enqueue(task)) {
+            enqueue_overflow(&task, 1, task->priority);
+        }
+    }
+    
+    void enqueue_overflow(task_t* const* first, size_t count, task_priority priority) {
+        overflow_lock_.lock();
+        overflow_[priority].insert(overflow_[priority].end(), first, first + count);
+        overflow_size_.fetch_add(static_cast< int32_t >(count), memory_order_relaxed);
+        overflow_lock_.unlock();
+    }
+    
+    bool dequeue_shared(int level, task_t*& run) {
+        if (tasks[level]->dequeue(run)) {
+            return true;
+        }
+        
+        if (overflow_size_.load(memory_order_relaxed) == 0) {
+            return false;
+        }
+        
+        bool success = false;
+        overflow_lock_.lock();
+        if (!overflow_[level].empty()) {
+            run = overflow_[level].front();
+            overflow_[level].pop_front();
+            overflow_size_.fetch_sub(1, memory_order_relaxed);
+            success = true;
+        }
+        
+        overflow_lock_.unlock();
+        return success;
+    }
+    
+    // To the mailbox of the task's worker, even from that worker itself, so
+    // a hinted task isn't stolen from its deque straight away
+    void post(task_t* task) {
+        mailbox& box = workers_[task->affinity]->mailbox_;
+        box.lock.lock();
+        if (task->pinned) {
+            box.pinned[task->priority].push_back(task);
+        }
+        else {
+            mailbox::letter mail = { task, internal::now_ns() };
+            box.hinted[task->priority].push_back(mail);
+            atomic_increment(box.hinted_size);
+        }
+        
+        atomic_increment(box.size);
+        box.lock.unlock();
+        
+        // Wake the owner if it's parked. Only it may run a pinned task, and
+        // it may be parked in a wait rather than idle. Otherwise a hinted
+        // task wakes one thread, which sleeps on until it may take it.
+        bool woken = idle.notify(worker_mask(task->affinity));
+        if (task->pinned) {
+            waiting.notify_all();
+        }
+        else if (!woken) {
+            notify_work();
+        }
+    }
+    
+    // Masks of workers 32 apart collide; a wake meant for the other then
+    // just comes to one thread too many
+    static uint32_t worker_mask(int32_t worker) {
+        return 1u << (worker % 32);
+    }
+    
+    // The owner's side, pinned tasks first
+    template< typename Predicate >
+    bool take_mail(worker_thread_data* worker, int level, task_t*& run, Predicate const& accept) {
+        mailbox& box = worker->mailbox_;
+        if (box.size == 0) {
+            return false;
+        }
+        
+        bool success = false;
+        box.lock.lock();
+        if (!box.pinned[level].empty() && accept(box.pinned[level].front())) {
+            run = box.pinned[level].front();
+            box.pinned[level].pop_front();
+            success = true;
+        }
+        else if (!box.hinted[level].empty() && accept(box.hinted[level].front().task)) {
+            run = box.hinted[level].front().task;
+            box.hinted[level].pop_front();
+            atomic_decrement(box.hinted_size);
+            success = true;
+        }
+        
+        if (success) {
+            atomic_decrement(box.size);
+        }
+        
+        box.lock.unlock();
+        return success;
+    }
+    
+    // Everyone else's side: the oldest hinted task of another worker, once
+    // it has waited long enough
+    template< typename Predicate >
+    bool steal_mail(worker_thread_data* thief, int level, task_t*& run, Predicate const& accept) {
+        uint64_t now = 0;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            mailbox& box = workers_[i]->mailbox_;
+            if (workers_[i] == thief || box.hinted_size == 0) {
+                continue;
+            }
+            
+            if (now == 0) {
+                now = internal::now_ns();
+            }
+            
+            box.lock.lock();
+            std::deque< mailbox::letter >& hinted = box.hinted[level];
+            bool success = !hinted.empty() && hinted.front().posted_ns + settings_.affinity_delay_ns <= now && accept(hinted.front().task);
+            if (success) {
+                run = hinted.front().task;
+                hinted.pop_front();
+                atomic_decrement(box.hinted_size);
+                atomic_decrement(box.size);
+            }
+            
+            box.lock.unlock();
+            if (success) {
+                trace(internal::kTraceSteal, static_cast< int32_t >(i));
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    // When the oldest task hinted to another worker may be taken, 0 if
+    // there's none
+    uint64_t hinted_due(worker_thread_data* worker) {
+        uint64_t oldest = 0;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            mailbox& box = workers_[i]->mailbox_;
+            if (workers_[i] == worker || box.hinted_size == 0) {
+                continue;
+            }
+            
+            box.lock.lock();
+            for (int level = 0; level < kNumPriorities; ++level) {
+                if (!box.hinted[level].empty() && (oldest == 0 || box.hinted[level].front().posted_ns < oldest)) {
+                    oldest = box.hinted[level].front().posted_ns;
+                }
+            }
+            
+            box.lock.unlock();
+        }
+        
+        return oldest == 0 ? 0 : oldest + settings_.affinity_delay_ns;
+    }
+    
+    // Records on the calling worker's ring, other threads share one and
+    // each get a track of their own in it
+    void trace(internal::trace_event_type type, int32_t arg) {
+#if TASK_SCHEDULER_TRACE
+        worker_thread_data* worker = local_worker();
+        if (worker != 0) {
+            worker->trace_.record(type, arg);
+            return;
+        }
+        
+        external_trace_lock_.lock();
+        external_trace_.record(type, arg, internal::trace_thread());
+        external_trace_lock_.unlock();
+#else
+        (void)type;
+        (void)arg;
+#endif
+    }
+    
+    // push_ready for count tasks of the same priority
+    void push_ready_bulk(task_t* const* first, size_t count, task_priority priority) {
+        if (count == 0) {
+            return;
+        }
+        
+        worker_thread_data* worker = local_worker();
+        if (worker != 0) {
+            worker->tasks_[priority].push_bulk(first, count);
+            worker->stats_.queue_depth(worker->tasks_[priority].size());
+        }
+        else {
+            size_t enqueued = tasks[priority]->enqueue_bulk(first, count);
+            if (enqueued != count) {
+                enqueue_overflow(first + enqueued, count - enqueued, priority);
+            }
+        }
+        
+        notify_all_work();
+    }
+    
+    bool find_task(worker_thread_data* worker, task_t*& run) {
+        if (worker != 0 && ++worker->picks_ % kAgingInterval == 0) {
+            for (int level = kNumPriorities - 1; level >= 0; --level) {
+                if (find_task(worker, level, run)) {
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        for (int level = 0; level < kNumPriorities; ++level) {
+            if (find_task(worker, level, run)) {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    bool find_task(worker_thread_data* worker, int level, task_t*& run) {
+        // Tasks sent to this worker can't go anywhere else, or not yet
+        if (worker != 0 && take_mail(worker, level, run, any_task())) {
+            return true;
+        }
+        
+        // empty() is exact for the owner and saves try_pop's fence
+        if (worker != 0 && !worker->tasks_[level].empty() && worker->tasks_[level].try_pop(run)) {
+            return true;
+        }
+        
+        if (dequeue_shared(level, run)) {
+            return true;
+        }
+        
+        return steal_task(worker, level, run, any_task()) || steal_mail(worker, level, run, any_task());
+    }
+    
+    // While waiting inside a task, tasks below the running one come first:
+    // they are usually what's being waited for and, as the depth only grows,
+    // running them can't lead back to the frame that's waiting. Anything
+    // else is fair game until waits nest kMaxWaitNesting deep.
+    bool find_task_while_waiting(worker_thread_data* worker, internal::thread_context const& current, task_t*& run, size_t& requeues) {
+        if (current.task_depth == 0) {
+            return find_task(worker, run);
+        }
+        
+        deeper_than deeper = { current.task_depth };
+        for (int level = 0; level < kNumPriorities; ++level) {
+            if (worker != 0 && (take_mail(worker, level, run, deeper) || worker->tasks_[level].try_pop_if(run, deeper))) {
+                return true;
+            }
+            
+            if (steal_task(worker, level, run, deeper) || steal_mail(worker, level, run, deeper)) {
+                return true;
+            }
+        }
+        
+        if (current.wait_nesting <= kMaxWaitNesting) {
+            return find_task(worker, run);
+        }
+        
+        // The shared queue can't be searched, so past the limit a task from
+        // it that isn't deeper goes back to its end. Without this a thread
+        // that isn't a worker, with no workers to take its tasks, could wait
+        // on one only it can reach. Each one moved back loses its place, so
+        // that happens about once per queued task until the caller runs
+        // something and allows another pass.
+        for (int level = 0; level < kNumPriorities && requeues != 0; ++level) {
+            if (dequeue_shared(level, run)) {
+                if (deeper(run)) {
+                    return true;
+                }
+                
+                // Others may have filled the queue meanwhile
+                enqueue_shared(run);
+                --requeues;
+            }
+        }
+        
+        return false;
+    }
+    
+    struct any_task
+    {
+        bool operator()(task_t*) const { return true; }
+    };
+    
+    struct deeper_than
+    {
+        int32_t depth;
+        
+        bool operator()(task_t* task) const { return task->depth > depth; }
+    };
+    
+    struct task_finished
+    {
+        task_t const* task;
+        uint32_t generation;
+        
+        bool operator()() const {
+            return task->generation != generation || task->open_work_items <= 0;
+        }
+    };
+    
+    // Workers try the nearest victims first, see cpu_topology::steal_order
+    template< typename Predicate >
+    bool steal_task(worker_thread_data* thief, int level, task_t*& run, Predicate const& accept) {
+        if (thief != 0) {
+            for (size_t i = 0; i < thief->steal_order_.size(); ++i) {
+                bool success = workers_[thief->steal_order_[i]]->tasks_[level].try_steal_if(run, accept);
+                thief->stats_.steal_attempt(success);
+                if (success) {
+                    thief->trace_.record(internal::kTraceSteal, thief->steal_order_[i]);
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            if (workers_[i]->tasks_[level].try_steal_if(run, accept)) {
+                trace(internal::kTraceSteal, static_cast< int32_t >(i));
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void execute(task_t* run) {
+        // Graph nodes aren't in open_tasks, they finish themselves at the end
+        // of their closure and may be reset for the next run right after
+        task_id id = run->id;
+        if (!run->work.empty() && cancelled(run)) {
+            run->work.discard();
+        }
+        else if (!run->work.empty()) {
+            internal::thread_context& current = internal::current_thread_context();
+            void* task = current.task;
+            void* owner = current.task_owner;
+            int32_t depth = current.task_depth;
+            current.task = run;
+            current.task_owner = this;
+            current.task_depth = run->depth;
+            trace(internal::kTraceTaskBegin, id);
+            run->work.run();
+            trace(internal::kTraceTaskEnd, id);
+            current.task = task;
+            current.task_owner = owner;
+            current.task_depth = depth;
+        }
+        
+        if (id != kNullTask) {
+            decrement_task(id);
+        }
+    }
+    
+    // Every task holds its parent open, so the chain can be walked for as
+    // long as the task is
+    bool cancelled(task_t const* task) const {
+        while (true) {
+            if (task->cancelled == task->generation + 1) {
+                return true;
+            }
+            
+            if (task->parent == kNullTask) {
+                return false;
+            }
+            
+            task = &open_tasks[task->parent];
+        }
+    }
+    
     void decrement_task(task_id task) {        
         task_t* current = &open_tasks[task];
         while (current != 0) {
-            if (!waiting_on_task) {
-                evaluate_dependencies();
-            }
-            
             task_t* deletion = current;
             int items = atomic_decrement(current->open_work_items);
             if (items == 0) {
+                release_successors(deletion);
+                
                 if (current->parent != kNullTask) {
                     current = &open_tasks[current->parent];
                 }
@@ -212,8 +1012,15 @@ private:
                 // remove the task from the open_list
                 atomic_decrement(num_tasks);
                 task_id deletedid = deletion->id;
+                bool waiters = deletion->has_waiters;
+                deletion->successors_lock.lock();
                 task_initialize(deletion);
+                atomic_increment(deletion->generation);
+                deletion->successors_lock.unlock();
                 availableIds.push(deletedid);
+                if (waiters) {
+                    wake_helpers();
+                }
             }
             else {
                 current = 0;
@@ -221,25 +1028,17 @@ private:
         }
     }
     
-    void evaluate_dependencies() {
-        if (dependency_lock.try_lock()) {
-            std::queue< int > deletions;
-            for (int i = 0; i < dependents_hold.size(); ++i) {
-                task_t* dependent = dependents_hold[i];
-                task_t* depends_on = &open_tasks[dependent->depends_on];
-                if (depends_on->open_work_items <= 0) {
-                    deletions.push(i);
-                    tasks.enqueue(dependent);
-                }
-            }
-
-            while (deletions.empty() == false) {
-                int index = deletions.back();
-                deletions.pop();
-                dependents_hold.erase(dependents_hold.begin() + index);
+    void release_successors(task_t* task) {
+        task->successors_lock.lock();
+        task->finished = true;
+        task->successors_lock.unlock();
+        
+        for (size_t i = 0; i < task->successors.size(); ++i) {
+            task_t* successor = &open_tasks[task->successors[i]];
+            if (atomic_decrement(successor->unfinished_dependencies) == 0) {
+                trace(internal::kTraceRelease, successor->id);
+                push_ready(successor);
             }
-            
-            dependency_lock.unlock();
         }
     }
     
@@ -247,16 +1046,24 @@ private:
     
 private:
     
-    mpsc_queue< task_id > availableIds;
-    mpmc_bounded_queue< task_t* > tasks;
-    std::vector< task_t* > dependents_hold;
-    spin_lock dependency_lock;
-    std::vector< worker_thread_data > workers_;
+    scheduler_settings const settings_;
+    index_free_list availableIds;
+    mpmc_bounded_queue< task_t* >* tasks[kNumPriorities]; // ready tasks pushed from outside the pool
+    std::deque< task_t* > overflow_[kNumPriorities];        // and those that didn't fit, see enqueue_shared
+    spin_lock overflow_lock_;
+    atomic< int32_t > overflow_size_;
+    std::vector< worker_thread_data* > workers_;
+    event_count idle;                   // workers out of work
+    event_count waiting;                // threads in help_until
+#if TASK_SCHEDULER_TRACE
+    internal::trace_clock trace_clock_;
+    internal::trace_buffer external_trace_;
+    spin_lock external_trace_lock_;
+#endif
     task_t* open_tasks;
     int32_t max_tasks;
     int32_t num_tasks;
-	bool kill;
-    bool waiting_on_task;
+	bool volatile kill;
 };
 
 #endif // TASK_HPP
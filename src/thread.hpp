@@ -14,6 +14,7 @@
 #include <cassert>
 #include <limits>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -104,7 +105,11 @@ inline void thread::sleep(uint64_t seconds, uint64_t nanoseconds) {
 }
 
 inline void thread::yield() {
+#if defined(__APPLE__)
 	pthread_yield_np();
+#else
+	sched_yield();
+#endif
 }
 
 inline thread::thread()
@@ -0,0 +1,256 @@
+/*
+ *  topology.hpp
+ *  Task Scheduler
+ *
+ */
+
+// CPU topology of the CPUs this process may run on. On Linux this comes from
+// sched_getaffinity and /sys/devices/system/cpu, elsewhere every available
+// CPU is treated as its own core on a single node. Schedulers use it to pin
+// worker i to cpu(i % size()) and to order steal victims nearest first: SMT
+// siblings, then cores sharing the last level cache, then the same NUMA
+// node, then everything else.
+
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+#include "scheduler_common.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct cpu_info
+{
+    int cpu;        // OS cpu number
+    int core;       // cores with the same core and package are SMT siblings
+    int package;
+    int cache;      // lowest cpu sharing this cpu's last level cache
+    int node;
+};
+
+class cpu_topology
+{
+public:
+
+    enum distance
+    {
+        kSameCore = 0,
+        kSameCache = 1,
+        kSameNode = 2,
+        kRemote = 3
+    };
+
+public:
+
+    // Detected once, on first use
+    static cpu_topology const& instance();
+
+    size_t size() const;
+
+    cpu_info const& cpu(size_t index) const;
+
+    distance between(size_t lhs, size_t rhs) const;
+
+    // Indices of the other workers in the order worker should try to steal
+    // from them, assuming worker i runs on cpu(firstCpu + i).
+    std::vector< int > steal_order(size_t worker, size_t numWorkers, size_t firstCpu = 0) const;
+
+    // Pins the calling thread to cpu(index % size()). Returns false where
+    // that isn't supported.
+    bool pin_current_thread(size_t index) const;
+
+private:
+
+    cpu_topology();
+
+    void detect();
+
+    static bool read_int(char const* path, int& value);
+
+    static bool read_cpu_list(char const* path, std::vector< int >& cpus);
+
+private:
+
+    std::vector< cpu_info > cpus_;
+};
+
+
+inline cpu_topology const& cpu_topology::instance() {
+    static cpu_topology topology;
+    return topology;
+}
+
+inline cpu_topology::cpu_topology() {
+    detect();
+    if (cpus_.empty()) {
+        int cores = internal::number_of_cores();
+        for (int i = 0; i < cores; ++i) {
+            cpu_info info = { i, i, 0, i, 0 };
+            cpus_.push_back(info);
+        }
+    }
+}
+
+inline size_t cpu_topology::size() const {
+    return cpus_.size();
+}
+
+inline cpu_info const& cpu_topology::cpu(size_t index) const {
+    return cpus_[index % cpus_.size()];
+}
+
+inline cpu_topology::distance cpu_topology::between(size_t lhs, size_t rhs) const {
+    cpu_info const& a = cpu(lhs);
+    cpu_info const& b = cpu(rhs);
+    if (a.package == b.package && a.core == b.core) {
+        return kSameCore;
+    }
+
+    if (a.cache == b.cache) {
+        return kSameCache;
+    }
+
+    if (a.node == b.node) {
+        return kSameNode;
+    }
+
+    return kRemote;
+}
+
+inline std::vector< int > cpu_topology::steal_order(size_t worker, size_t numWorkers, size_t firstCpu) const {
+    // Sort by distance, then by how far after us the victim is so that
+    // equally near workers aren't all hammered in the same order.
+    std::vector< std::pair< int, int > > keyed;
+    for (size_t i = 1; i < numWorkers; ++i) {
+        size_t victim = (worker + i) % numWorkers;
+        keyed.push_back(std::make_pair(static_cast< int >(between(firstCpu + worker, firstCpu + victim)) * static_cast< int >(numWorkers) + static_cast< int >(i), static_cast< int >(victim)));
+    }
+
+    std::sort(keyed.begin(), keyed.end());
+    std::vector< int > order;
+    for (size_t i = 0; i < keyed.size(); ++i) {
+        order.push_back(keyed[i].second);
+    }
+
+    return order;
+}
+
+inline bool cpu_topology::pin_current_thread(size_t index) const {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu(index).cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+inline void cpu_topology::detect() {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return;
+    }
+
+    // Map each cpu to its NUMA node, if the kernel exposes them
+    std::vector< int > nodes(CPU_SETSIZE, 0);
+    for (int node = 0; node < 1024; ++node) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        std::vector< int > members;
+        if (!read_cpu_list(path, members)) {
+            break;
+        }
+
+        for (size_t i = 0; i < members.size(); ++i) {
+            if (members[i] < CPU_SETSIZE) {
+                nodes[members[i]] = node;
+            }
+        }
+    }
+
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (!CPU_ISSET(c, &set)) {
+            continue;
+        }
+
+        cpu_info info = { c, c, 0, c, nodes[c] };
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", c);
+        read_int(path, info.core);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+        read_int(path, info.package);
+
+        // The highest cache level is the last level cache
+        int best_level = 0;
+        for (int index = 0; index < 16; ++index) {
+            int level = 0;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", c, index);
+            if (!read_int(path, level)) {
+                break;
+            }
+
+            std::vector< int > shared;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", c, index);
+            if (level > best_level && read_cpu_list(path, shared) && !shared.empty()) {
+                best_level = level;
+                info.cache = *std::min_element(shared.begin(), shared.end());
+            }
+        }
+
+        cpus_.push_back(info);
+    }
+#endif
+}
+
+inline bool cpu_topology::read_int(char const* path, int& value) {
+    FILE* file = fopen(path, "r");
+    if (file == 0) {
+        return false;
+    }
+
+    bool success = fscanf(file, "%d", &value) == 1;
+    fclose(file);
+    return success;
+}
+
+// Parses the kernel's cpu list format, e.g. "0-3,8,10-11"
+inline bool cpu_topology::read_cpu_list(char const* path, std::vector< int >& cpus) {
+    FILE* file = fopen(path, "r");
+    if (file == 0) {
+        return false;
+    }
+
+    int first = 0;
+    while (fscanf(file, "%d", &first) == 1) {
+        int last = first;
+        int separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+
+            separator = fgetc(file);
+        }
+
+        for (int c = first; c <= last; ++c) {
+            cpus.push_back(c);
+        }
+
+        if (separator != ',') {
+            break;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+#endif // TOPOLOGY_HPP
@@ -0,0 +1,248 @@
+/*
+ *  trace.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Timeline tracing for task_manager: task begin and end, steals, parks and
+// dependency releases, stamped with the cpu's tick counter. Each worker
+// records into its own ring of the last kTraceCapacity events, which only
+// it writes, so recording is a tick read and four plain stores. Threads
+// that aren't workers share one more ring behind a lock, tagging their
+// events with a number of their own so each gets its own track.
+// task_manager::write_trace turns the rings into Chrome trace event JSON,
+// which chrome://tracing and ui.perfetto.dev open.
+//
+// Compiled out unless TASK_SCHEDULER_TRACE is defined to 1. Otherwise the
+// recorders are empty and write_trace writes an empty trace.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "atomic.hpp"
+#include "scheduler_common.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#ifndef TASK_SCHEDULER_TRACE
+#define TASK_SCHEDULER_TRACE 0
+#endif
+
+namespace internal
+{
+    enum { kTraceCapacity = 1 << 16 };     // events per ring, a power of two
+
+    enum trace_event_type
+    {
+        kTraceTaskBegin,
+        kTraceTaskEnd,
+        kTraceSteal,                        // arg is the victim worker
+        kTraceParkBegin,
+        kTraceParkEnd,
+        kTraceRelease                       // arg is the task made runnable, -1 for graph nodes
+    };
+
+    struct trace_event
+    {
+        uint64_t ticks;
+        int32_t arg;
+        uint16_t type;
+        uint16_t thread;                    // 0 in a worker's ring
+    };
+    
+    // The calling thread's number for the shared ring, from 1 up
+    inline uint16_t trace_thread() {
+        static atomic< uint32_t > next;     // zero before anything runs
+        static THREAD_LOCAL uint16_t thread = 0;
+        if (thread == 0) {
+            thread = static_cast< uint16_t >(next.fetch_add(1, memory_order_relaxed) % 0xffff + 1);
+        }
+        
+        return thread;
+    }
+
+    // rdtsc and cntvct are a few cycles and don't serialize, which is
+    // precise enough for a timeline
+    inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (ticks));
+        return ticks;
+#else
+        return now_ns();
+#endif
+    }
+
+    class trace_buffer
+    {
+    public:
+
+#if TASK_SCHEDULER_TRACE
+        trace_buffer()
+        : events_(new trace_event[kTraceCapacity]) {
+            head_.store(0, memory_order_relaxed);
+        }
+
+        ~trace_buffer() {
+            delete [] events_;
+        }
+
+        // Owner only, or under a lock
+        void record(trace_event_type type, int32_t arg, uint16_t thread = 0) {
+            uint64_t head = head_.load(memory_order_relaxed);
+            trace_event& event = events_[head & (kTraceCapacity - 1)];
+            event.ticks = trace_ticks();
+            event.arg = arg;
+            event.type = static_cast< uint16_t >(type);
+            event.thread = thread;
+            head_.store(head + 1, memory_order_release);
+        }
+
+        // Appends the events still in the ring, oldest first. May run while
+        // the owner records; events it could have overwritten meanwhile are
+        // dropped.
+        void copy(std::vector< trace_event >& out) const {
+            uint64_t head = head_.load(memory_order_acquire);
+            uint64_t first = head > kTraceCapacity ? head - kTraceCapacity : 0;
+            std::vector< trace_event > events;
+            events.reserve(head - first);
+            for (uint64_t i = first; i < head; ++i) {
+                events.push_back(events_[i & (kTraceCapacity - 1)]);
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            uint64_t overwritten = head_.load(memory_order_relaxed);
+            overwritten = overwritten > kTraceCapacity ? overwritten - kTraceCapacity : 0;
+            for (uint64_t i = std::max(first, overwritten); i < head; ++i) {
+                out.push_back(events[i - first]);
+            }
+        }
+
+    private:
+
+        trace_event* events_;
+        atomic< uint64_t > head_;
+
+        trace_buffer(trace_buffer const&);
+        void operator=(trace_buffer const&);
+#else
+        void record(trace_event_type, int32_t, uint16_t = 0) {}
+        void copy(std::vector< trace_event >&) const {}
+#endif
+    };
+
+    // Pairs a tick count with the time, to convert ticks to microseconds
+    // at the rate measured since
+    class trace_clock
+    {
+    public:
+
+        trace_clock()
+        : ticks_(trace_ticks()),
+          ns_(now_ns()) {
+        }
+
+        uint64_t start_ticks() const {
+            return ticks_;
+        }
+
+        double ticks_per_us() const {
+            uint64_t ticks = trace_ticks() - ticks_;
+            uint64_t ns = now_ns() - ns_;
+            return ns == 0 || ticks == 0 ? 1000.0 : ticks * 1000.0 / ns;
+        }
+
+    private:
+
+        uint64_t ticks_;
+        uint64_t ns_;
+    };
+
+    // One track per ring, named by names[i], or per thread for the shared
+    // ring. Ends without a begin, left behind when the ring wrapped, are
+    // skipped.
+    inline void write_chrome_trace(std::ostream& out, std::vector< trace_buffer const* > const& buffers, std::vector< std::string > const& names, trace_clock const& clock) {
+        double rate = clock.ticks_per_us();
+        char const* separator = "\n";
+        size_t track = 0;
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        for (size_t buffer = 0; buffer < buffers.size(); ++buffer) {
+            std::vector< trace_event > events;
+            buffers[buffer]->copy(events);
+            std::vector< uint16_t > threads;
+            for (size_t i = 0; i < events.size(); ++i) {
+                if (std::find(threads.begin(), threads.end(), events[i].thread) == threads.end()) {
+                    threads.push_back(events[i].thread);
+                }
+            }
+            
+            if (threads.empty()) {
+                threads.push_back(0);
+            }
+            
+            for (size_t t = 0; t < threads.size(); ++t, ++track) {
+                out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+                    << ",\"args\":{\"name\":\"" << names[buffer];
+                if (threads[t] != 0) {
+                    out << " " << threads[t];
+                }
+                
+                out << "\"}}";
+                separator = ",\n";
+                
+                int open = 0;
+                for (size_t i = 0; i < events.size(); ++i) {
+                    trace_event const& event = events[i];
+                    if (event.thread != threads[t] || ((event.type == kTraceTaskEnd || event.type == kTraceParkEnd) && open == 0)) {
+                        continue;
+                    }
+                    
+                    char timestamp[32];
+                    snprintf(timestamp, sizeof(timestamp), "%.3f", (event.ticks - clock.start_ticks()) / rate);
+                    out << separator;
+                    switch (event.type) {
+                        case kTraceTaskBegin:
+                            ++open;
+                            if (event.arg >= 0) {
+                                out << "{\"name\":\"task " << event.arg << "\",\"cat\":\"task\",\"ph\":\"B\"";
+                            }
+                            else {
+                                out << "{\"name\":\"graph node\",\"cat\":\"task\",\"ph\":\"B\"";
+                            }
+                            break;
+                        case kTraceTaskEnd:
+                            --open;
+                            out << "{\"ph\":\"E\"";
+                            break;
+                        case kTraceParkBegin:
+                            ++open;
+                            out << "{\"name\":\"parked\",\"cat\":\"park\",\"ph\":\"B\"";
+                            break;
+                        case kTraceParkEnd:
+                            --open;
+                            out << "{\"ph\":\"E\"";
+                            break;
+                        case kTraceSteal:
+                            out << "{\"name\":\"steal\",\"cat\":\"steal\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"victim\":" << event.arg << "}";
+                            break;
+                        case kTraceRelease:
+                            out << "{\"name\":\"release\",\"cat\":\"dependency\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"task\":" << event.arg << "}";
+                            break;
+                    }
+                    
+                    out << ",\"ts\":" << timestamp << ",\"pid\":1,\"tid\":" << track << "}";
+                }
+            }
+        }
+        
+        out << "\n]}\n";
+    }
+}
+
+#endif // TRACE_HPP
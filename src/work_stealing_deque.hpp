@@ -0,0 +1,251 @@
+/*
+ *  work_stealing_deque.hpp
+ *  Task Scheduler
+ *
+ */
+
+// Lock-free, growable work-stealing deque after Chase & Lev, "Dynamic Circular
+// Work-Stealing Deque" (SPAA '05). The owning thread pushes and pops at the
+// bottom without any atomic read-modify-write; thieves steal from the top with
+// a CAS, and the owner only CASes when it races a thief for the last element.
+// Arrays that have been grown out of are kept alive until the deque is
+// destroyed, since a thief may still be reading from one.
+
+#ifndef WORK_STEALING_DEQUE_HPP
+#define WORK_STEALING_DEQUE_HPP
+
+#include "atomic.hpp"
+#include <cstddef>
+
+template< typename T >
+class work_stealing_deque
+{
+public:
+
+    typedef T value_type;
+
+public:
+
+    explicit work_stealing_deque(size_t size = 64);
+
+    ~work_stealing_deque();
+
+    // Owner thread only
+    void push(value_type const& value);
+
+    // Owner thread only, publishes all count values with a single store
+    void push_bulk(value_type const* first, size_t count);
+
+    // Owner thread only
+    bool try_pop(value_type& value);
+
+    // Any thread
+    bool try_steal(value_type& value);
+
+    // As try_pop and try_steal, but leave the value in the deque unless
+    // accept(value) returns true
+    template< typename Predicate >
+    bool try_pop_if(value_type& value, Predicate const& accept);
+
+    template< typename Predicate >
+    bool try_steal_if(value_type& value, Predicate const& accept);
+
+    // Any thread, only a hint unless called by the owner
+    bool empty() const;
+
+    // Any thread, only a hint unless called by the owner
+    size_t size() const;
+
+private:
+
+    struct circular_array
+    {
+        explicit circular_array(size_t size)
+        : mask(size - 1),
+          elements(new T[size]),
+          previous(0) {
+            assert((size >= 2) && ((size & (size - 1)) == 0));
+        }
+
+        ~circular_array() {
+            delete [] elements;
+        }
+
+        T& get(intptr_t index) {
+            return elements[index & mask];
+        }
+
+        circular_array* grow(intptr_t bottom, intptr_t top) {
+            circular_array* array = new circular_array((mask + 1) * 2);
+            for (intptr_t i = top; i != bottom; ++i) {
+                array->get(i) = get(i);
+            }
+
+            array->previous = this;
+            return array;
+        }
+
+        size_t const mask;
+        T* const elements;
+        circular_array* previous;
+    };
+
+private:
+
+    work_stealing_deque(work_stealing_deque const&);
+    work_stealing_deque& operator=(work_stealing_deque const&);
+
+private:
+
+    enum { kCachelineSize = 64 };
+    typedef char cacheline_pad [kCachelineSize];
+
+    cacheline_pad pad0_;
+    atomic< intptr_t > top_;
+    cacheline_pad pad1_;
+    atomic< intptr_t > bottom_;
+    atomic< circular_array* > array_;
+    cacheline_pad pad2_;
+};
+
+
+template< typename T >
+work_stealing_deque< T >::work_stealing_deque(size_t size) {
+    top_.store(0, memory_order_relaxed);
+    bottom_.store(0, memory_order_relaxed);
+    array_.store(new circular_array(size), memory_order_relaxed);
+}
+
+template< typename T >
+work_stealing_deque< T >::~work_stealing_deque() {
+    circular_array* array = array_.load(memory_order_relaxed);
+    while (array != 0) {
+        circular_array* previous = array->previous;
+        delete array;
+        array = previous;
+    }
+}
+
+template< typename T >
+inline void work_stealing_deque< T >::push(typename work_stealing_deque< T >::value_type const& value) {
+    intptr_t bottom = bottom_.load(memory_order_relaxed);
+    intptr_t top = top_.load(memory_order_acquire);
+    circular_array* array = array_.load(memory_order_relaxed);
+    if (bottom - top > static_cast< intptr_t >(array->mask)) {
+        array = array->grow(bottom, top);
+        array_.store(array, memory_order_release);
+    }
+
+    array->get(bottom) = value;
+    bottom_.store(bottom + 1, memory_order_release);
+}
+
+template< typename T >
+inline void work_stealing_deque< T >::push_bulk(typename work_stealing_deque< T >::value_type const* first, size_t count) {
+    intptr_t bottom = bottom_.load(memory_order_relaxed);
+    intptr_t top = top_.load(memory_order_acquire);
+    circular_array* array = array_.load(memory_order_relaxed);
+    while (bottom + static_cast< intptr_t >(count) - top > static_cast< intptr_t >(array->mask + 1)) {
+        array = array->grow(bottom, top);
+        array_.store(array, memory_order_release);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        array->get(bottom + i) = first[i];
+    }
+
+    bottom_.store(bottom + count, memory_order_release);
+}
+
+template< typename T >
+inline bool work_stealing_deque< T >::try_pop(typename work_stealing_deque< T >::value_type& value) {
+    intptr_t bottom = bottom_.load(memory_order_relaxed) - 1;
+    circular_array* array = array_.load(memory_order_relaxed);
+    bottom_.store(bottom, memory_order_relaxed);
+    memory_barrier();
+    intptr_t top = top_.load(memory_order_relaxed);
+    if (top > bottom) {
+        // empty
+        bottom_.store(bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    value = array->get(bottom);
+    if (top < bottom) {
+        return true;
+    }
+
+    // Last element, race any thieves for it
+    bool won = top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst);
+    bottom_.store(bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+template< typename T >
+inline bool work_stealing_deque< T >::try_steal(typename work_stealing_deque< T >::value_type& value) {
+    intptr_t top = top_.load(memory_order_acquire);
+    memory_barrier();
+    intptr_t bottom = bottom_.load(memory_order_acquire);
+    if (top >= bottom) {
+        return false;
+    }
+
+    circular_array* array = array_.load(memory_order_acquire);
+    value = array->get(top);
+    return top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst);
+}
+
+template< typename T >
+template< typename Predicate >
+inline bool work_stealing_deque< T >::try_pop_if(typename work_stealing_deque< T >::value_type& value, Predicate const& accept) {
+    // Only the owner writes elements, and the bottom one can be stolen but
+    // not replaced, so if try_pop succeeds it returns what we looked at
+    intptr_t bottom = bottom_.load(memory_order_relaxed) - 1;
+    intptr_t top = top_.load(memory_order_acquire);
+    if (top > bottom) {
+        return false;
+    }
+
+    circular_array* array = array_.load(memory_order_relaxed);
+    if (!accept(array->get(bottom))) {
+        return false;
+    }
+
+    return try_pop(value);
+}
+
+template< typename T >
+template< typename Predicate >
+inline bool work_stealing_deque< T >::try_steal_if(typename work_stealing_deque< T >::value_type& value, Predicate const& accept) {
+    intptr_t top = top_.load(memory_order_acquire);
+    memory_barrier();
+    intptr_t bottom = bottom_.load(memory_order_acquire);
+    if (top >= bottom) {
+        return false;
+    }
+
+    // The copy may be stale, in which case top has moved and the CAS fails
+    circular_array* array = array_.load(memory_order_acquire);
+    value = array->get(top);
+    if (!accept(value)) {
+        return false;
+    }
+
+    return top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst);
+}
+
+template< typename T >
+inline bool work_stealing_deque< T >::empty() const {
+    intptr_t top = top_.load(memory_order_acquire);
+    intptr_t bottom = bottom_.load(memory_order_acquire);
+    return top >= bottom;
+}
+
+template< typename T >
+inline size_t work_stealing_deque< T >::size() const {
+    intptr_t top = top_.load(memory_order_acquire);
+    intptr_t bottom = bottom_.load(memory_order_acquire);
+    return bottom > top ? static_cast< size_t >(bottom - top) : 0;
+}
+
+#endif // WORK_STEALING_DEQUE_HPP
@@ -32,6 +32,21 @@ public:
     
     void push_back(value_type const& value);
     
+    // Same owner/thief interface as work_stealing_deque, so the schedulers
+    // can be instantiated with either: the owner works LIFO at the back and
+    // thieves take the oldest task from the front.
+    void push(value_type const& value);
+    
+    void push_bulk(value_type const* first, size_t count);
+    
+    bool try_pop(value_type& value);
+    
+    bool try_steal(value_type& value);
+    
+    bool empty();
+    
+    size_t size();
+    
 private:
     
     std::deque< T > deque_;
@@ -82,4 +97,42 @@ inline void work_stealing_lock_deque< T >::push_back(typename work_stealing_lock
     mutex_.unlock();
 }
 
+template< typename T >
+inline void work_stealing_lock_deque< T >::push(typename work_stealing_lock_deque< T >::value_type const& value) {
+    push_back(value);
+}
+
+template< typename T >
+inline void work_stealing_lock_deque< T >::push_bulk(typename work_stealing_lock_deque< T >::value_type const* first, size_t count) {
+    mutex_.lock();
+    deque_.insert(deque_.end(), first, first + count);
+    mutex_.unlock();
+}
+
+template< typename T >
+inline bool work_stealing_lock_deque< T >::try_pop(typename work_stealing_lock_deque< T >::value_type& value) {
+    return try_pop_back(value);
+}
+
+template< typename T >
+inline bool work_stealing_lock_deque< T >::try_steal(typename work_stealing_lock_deque< T >::value_type& value) {
+    return try_pop_front(value);
+}
+
+template< typename T >
+inline bool work_stealing_lock_deque< T >::empty() {
+    mutex_.lock();
+    bool result = deque_.empty();
+    mutex_.unlock();
+    return result;
+}
+
+template< typename T >
+inline size_t work_stealing_lock_deque< T >::size() {
+    mutex_.lock();
+    size_t result = deque_.size();
+    mutex_.unlock();
+    return result;
+}
+
 #endif // WORK_STEALING_LOCK_DEQUE_HPP
\ No newline at end of file
@@ -11,16 +11,33 @@
 #define WORK_STEALING_LOCK_SCHEDULER_HPP
 
 #include "atomic.hpp"
+#include "coroutine.hpp"
+#include "event_count.hpp"
+#include "mpsc_queue.hpp"
+#include "work_stealing_deque.hpp"
 #include "work_stealing_lock_deque.hpp"
 #include "scheduler_common.hpp"
+#include "scheduler_settings.hpp"
+#include "scheduler_stats.hpp"
 #include "thread.hpp"
+#include "topology.hpp"
+#include <algorithm>
 #include <vector>
 
-class work_stealing_lock_scheduler
+// TaskDeque must provide the owner side push/try_pop and the thief side
+// try_steal (see work_stealing_deque and work_stealing_lock_deque). Tasks
+// submitted from outside the pool can't be pushed onto a worker's deque, as
+// only the owner may do that, so they go to the worker's locked inbox instead.
+// Tasks submitted to a particular worker with submit_to go to a queue that
+// only it takes from, so they are never stolen.
+template< typename TaskDeque >
+class basic_work_stealing_scheduler
 {
 private:
     
-    typedef work_stealing_lock_deque< internal::task > task_deque;
+    typedef TaskDeque task_deque;
+    
+    enum { kSubmitBatchSize = 256 };
     
 private:
     
@@ -28,59 +45,116 @@ private:
 	{
 		thread thread_;
         task_deque tasks_;
-		work_stealing_lock_scheduler* scheduler_;
-        int victim_;
+        work_stealing_lock_deque< task_closure > inbox_;
+        pooled_mpsc_queue< task_closure > pinned_;
+		basic_work_stealing_scheduler* scheduler_;
+        int index_;
+        bool pin_;
+        std::vector< int > steal_order_;
+        worker_stats stats_;
 	};
 	
 	static void worker_thread_func(void* data) {
 		worker_thread_data* context = static_cast< worker_thread_data* >(data);
-		while (!context->scheduler_->kill_) {
-			internal::task task;
-			while(context->tasks_.try_pop_front(task)) {
-				task.func(task.context);
-                --(context->scheduler_->numTasks_);
+        basic_work_stealing_scheduler* scheduler = context->scheduler_;
+        internal::thread_context& current = internal::current_thread_context();
+        current.scheduler = scheduler;
+        current.worker = context;
+        if (context->pin_) {
+            cpu_topology::instance().pin_current_thread(context->index_);
+        }
+        
+        internal::idle_backoff backoff(scheduler->settings_, context->index_);
+		while (!scheduler->kill_) {
+			task_closure task;
+			while(context->pinned_.pop(task) || context->tasks_.try_pop(task) || context->inbox_.try_steal(task)) {
+                context->stats_.end_idle();
+				task.run();
+                scheduler->task_finished();
+                context->stats_.task_executed();
+                backoff.reset();
 			}
 			
+            context->stats_.begin_idle();
+            context->stats_.failed_poll();
+
+            // Sweep the victims nearest first (see cpu_topology::steal_order)
+            std::vector< int > const& order = context->steal_order_;
             int failure = 0;
-            work_stealing_lock_scheduler* scheduler = context->scheduler_;
+            size_t next = 0;
 			while (true) {
-			    if (context->scheduler_->kill_) {
+			    if (scheduler->kill_) {
 			        break;
 			    }
 			    
-                worker_thread_data& victim = *scheduler->workers_[context->victim_];
-                internal::task task;
-    			if (victim.tasks_.try_pop_back(task)) {
-                    task.func(task.context);
-                    //context->tasks_.push_back(task);
+                if (!order.empty()) {
+                    worker_thread_data& victim = *scheduler->workers_[order[next]];
+                    task_closure task;
+                    bool success = victim.tasks_.try_steal(task) || victim.inbox_.try_steal(task);
+                    context->stats_.steal_attempt(success);
+                    if (success) {
+                        context->stats_.end_idle();
+                        task.run();
+                        scheduler->task_finished();
+                        context->stats_.task_executed();
+                        backoff.reset();
+                        break;
+                    }
+                    
+                    next = (next + 1) % order.size();
+                }
+                
+                // A full sweep is one empty poll of the idle ladder, after
+                // which our own deque and inbox are worth another look
+                if (++failure < scheduler->workers_.size()) {
+                    active_pause();
+                    continue;
+                }
+                
+                if (backoff.idle()) {
                     break;
-    			}
-    			
-                context->victim_ = context->victim_ % scheduler->workers_.size();
-                ++failure;
-                if (failure >= scheduler->workers_.size()) {
-                    failure = 0;
-                    thread::sleep(0, 1000);
                 }
+                
+                // Nothing to steal anywhere, park until a submitter wakes us
+                failure = 0;
+                event_count::key key = scheduler->idle_.prepare_wait();
+                if (scheduler->kill_ || scheduler->has_work() || !context->pinned_.empty()) {
+                    scheduler->idle_.cancel_wait();
+                }
+                else {
+                    context->stats_.begin_park();
+                    scheduler->idle_.wait(key);
+                    context->stats_.end_park();
+                }
+                
+                break;
 			}			
 		}
 	}
     
 public:
     
-    work_stealing_lock_scheduler(size_t numThreads = 0)
-    : distributee_(0),
+    // See scheduler_settings for spinning workers
+    basic_work_stealing_scheduler(size_t numThreads = 0, scheduler_settings const& settings = scheduler_settings())
+    : settings_(settings),
+      distributee_(0),
       kill_(false) {
         numTasks_.store(0, memory_order_relaxed);
         if (numThreads == 0) {
 			numThreads = internal::number_of_cores();
 		}
+        
+        // Worker i is pinned to cpu i, unless that would oversubscribe a cpu
+        cpu_topology const& topology = cpu_topology::instance();
+        bool pin = numThreads <= topology.size();
 		
 		for (int i = 0; i < numThreads; ++i) {
 			worker_thread_data* worker = new worker_thread_data;
 			worker->thread_ = thread(worker_thread_func);
 			worker->scheduler_ = this;
-            worker->victim_ = (i + 1) % numThreads;
+            worker->index_ = i;
+            worker->pin_ = pin;
+            worker->steal_order_ = topology.steal_order(i, numThreads);
 			workers_.push_back(worker);
 		}
 		
@@ -89,57 +163,175 @@ public:
         }
     }
     
-    ~work_stealing_lock_scheduler() {
+    ~basic_work_stealing_scheduler() {
 		kill_ = true;
+        idle_.notify_all();
 		for (int i = 0; i < workers_.size(); ++i) {
 			workers_[i]->thread_.join();
+            delete workers_[i];
 		}
 	}
 	
+    // Spins for wait_spins polls, then parks until the last task finishes
 	void wait_for_all_tasks() {
-        int backoff = 0;
-        // Should investigate the proper usage of the memory_order parameter
+        internal::idle_backoff backoff(settings_.wait_spins, 0);
 	    while(numTasks_.load(memory_order_acquire) != 0) {
-	        if (backoff < 10) {
-                active_pause();
-	        }
-	        else if (backoff < 20) {
-                for (int i = 0; i != 50; ++i) {
-                    active_pause();
-                }
-	        }
-	        else if (backoff < 26) {
-                thread::yield();
-	        }
-	        else {
-                thread::sleep(0, 10000000);
-	        }
-	        
-            ++backoff;
+            if (backoff.idle()) {
+                continue;
+            }
+            
+            event_count::key key = done_.prepare_wait();
+            if (numTasks_.load(memory_order_acquire) == 0) {
+                done_.cancel_wait();
+                break;
+            }
+            
+            done_.wait(key);
 	    }
 	}
 	
 	void submit_task(task_function func, void* context) {
-        internal::task task = { func, context };
-        pthread_t id = thread::current_id();
-        for (int i = 0; i < workers_.size(); ++i) {
-            if (thread::ids_equal(id, workers_[i]->thread_.id())) {
-                workers_[i]->tasks_.push_back(task);
-                return;
+        submit(task_closure(func, context));
+	}
+    
+    // Runs a copy of f, see task_closure for how it's stored
+    template< typename F >
+    void submit_task(F const& f) {
+        submit(task_closure(f));
+    }
+    
+#if TASK_SCHEDULER_HAS_COROUTINES
+    // co_await scheduler.schedule() continues the coroutine on a worker,
+    // see coroutine.hpp. From a worker the resumption goes on its own deque.
+    schedule_operation< basic_work_stealing_scheduler > schedule() {
+        return schedule_operation< basic_work_stealing_scheduler >(*this);
+    }
+#endif
+    
+    // Runs the task on the given worker only, for tasks that use what that
+    // worker keeps to itself. Any thread may submit to any worker. Wakes
+    // every parked worker, as only the one given can run it.
+    void submit_to(size_t worker, task_function func, void* context) {
+        submit_pinned(worker, task_closure(func, context));
+    }
+    
+    template< typename F >
+    void submit_to(size_t worker, F const& f) {
+        submit_pinned(worker, task_closure(f));
+    }
+    
+    size_t num_workers() const {
+        return workers_.size();
+    }
+    
+    // Submits count tasks running func, one per context. A worker publishes
+    // each batch to its own deque with a single store, other threads hand
+    // each batch to the next worker's inbox under a single lock.
+    void submit_tasks(task_function func, void* const* contexts, size_t count) {
+        numTasks_.fetch_add(count, memory_order_relaxed);
+        worker_thread_data* worker = local_worker();
+        task_closure batch[kSubmitBatchSize];
+        size_t submitted = 0;
+        while (submitted < count) {
+            size_t size = std::min< size_t >(count - submitted, kSubmitBatchSize);
+            for (size_t i = 0; i < size; ++i) {
+                batch[i] = task_closure(func, contexts[submitted + i]);
+            }
+            
+            if (worker != 0) {
+                worker->tasks_.push_bulk(batch, size);
+                worker->stats_.queue_depth(worker->tasks_.size());
+            }
+            else {
+                workers_[distributee_]->inbox_.push_bulk(batch, size);
+                distributee_ = (distributee_ + 1) % workers_.size();
             }
+            
+            submitted += size;
         }
         
-        workers_[distributee_]->tasks_.push_back(task);
+        idle_.notify_all();
+    }
+    
+    // Counters summed over every worker, see scheduler_stats.hpp
+    scheduler_stats snapshot() const {
+        scheduler_stats total;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            total += workers_[i]->stats_.snapshot();
+        }
+        
+        return total;
+    }
+    
+    scheduler_stats snapshot(size_t worker) const {
+        return workers_[worker]->stats_.snapshot();
+    }
+    
+private:
+    
+    void submit(task_closure const& task) {
+        ++numTasks_;
+        worker_thread_data* worker = local_worker();
+        if (worker != 0) {
+            worker->tasks_.push(task);
+            worker->stats_.queue_depth(worker->tasks_.size());
+            idle_.notify_one();
+            return;
+        }
+        
+        workers_[distributee_]->inbox_.push(task);
         distributee_ = (distributee_ + 1) % workers_.size();
+        idle_.notify_one();
 	}
     
+    void submit_pinned(size_t worker, task_closure const& task) {
+        assert(worker < workers_.size());
+        ++numTasks_;
+        workers_[worker]->pinned_.push(task);
+        idle_.notify_all();
+    }
+    
+    // The calling thread's worker, or null if it isn't one of ours
+    worker_thread_data* local_worker() {
+        internal::thread_context& current = internal::current_thread_context();
+        if (current.scheduler == this) {
+            return static_cast< worker_thread_data* >(current.worker);
+        }
+        
+        return 0;
+    }
+    
+    // The final decrement's full barrier pairs with prepare_wait's in
+    // wait_for_all_tasks
+    void task_finished() {
+        if (--numTasks_ == 0) {
+            done_.notify_all();
+        }
+    }
+    
+    bool has_work() {
+        for (int i = 0; i < workers_.size(); ++i) {
+            if (!workers_[i]->tasks_.empty() || !workers_[i]->inbox_.empty()) {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
 protected:
     
+    scheduler_settings const settings_;
     std::vector< worker_thread_data* > workers_;
     atomic< size_t > numTasks_;
     size_t distributee_;
-	bool kill_;
+    event_count idle_;
+    event_count done_;      // wait_for_all_tasks parks here
+	bool volatile kill_;
 };
 
+typedef basic_work_stealing_scheduler< work_stealing_lock_deque< task_closure > > work_stealing_lock_scheduler;
+typedef basic_work_stealing_scheduler< work_stealing_deque< task_closure > > work_stealing_scheduler;
+
 #endif // WORK_STEALING_LOCK_SCHEDULER_HPP
 